@@ -20,6 +20,8 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE //recvmmsg, sendmmsg
+
 #include <stdio.h> 
 #include <stdbool.h>
 #include <stdlib.h>
@@ -36,11 +38,68 @@
 #include <arpa/inet.h> 
 #include <netinet/in.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#ifdef HAVE_MBELIB
+#include <math.h>
+#include <mbelib.h>
+#endif
 
 #define AMBE_ENCODE_GAIN -15
 #define AMBE_DECODE_GAIN 10
 #define BUFSIZE 2048
 #define TIMEOUT 60
+#define PING_INTERVAL 5000
+#define TX_FRAME_INTERVAL 20
+#define DMRIDS_FILE "DMRIds.dat"
+#define DMRIDS_CHECK_INTERVAL 10
+#define MAX_MASTERS 8
+#define MAX_RX_SESSIONS (2 * MAX_MASTERS)
+#define MAX_VOCODERS 8
+#define VOCODER_FIFO_SIZE 1024
+#define VOCODER_TIMEOUT 2000 //ms without a reply while frames are outstanding, before a channel is marked down
+#define WAV_FORMAT WAV_PCM //encoding of the wav recordings: WAV_PCM 16 bit, WAV_ULAW 8 bit G.711 (half the size) or WAV_IMA_ADPCM 4 bit (a quarter)
+#define AGC_TARGET 16384 //peak level the agc brings each frame to, -6 dBFS
+#define AGC_MAXGAIN 4096 //agc gain limit, +24 dB in 1/256 steps
+#define AGC_FLOOR 512 //frame peaks below this are pauses, the agc gain is held through them
+#define AMBE_MAX_ERRORS 3 //bits corrected in C0 and C1 above which a frame is not decoded, noise mostly scores 5-6
+#define AMBE_QUIET_GAMMA -8 //decoder gain, log2 in 1/16, under which a frame is written as silence. the silence frame settles at -21
+#define MIN_VOICE_FRAMES 50 //frames of speech, not counting silence and bad frames, a call needs to get a reply
+#define JITTER_DEPTH 4 //voice packets held back while waiting for a late one, a power of two up to 32 (the bits of rx_session.held)
+#define VOCODER_MAXINFLIGHT 150 //frames awaiting a reply, beyond that a channel is saturated (3s of audio behind)
+#define VOCODER_WINDOW 32 //frames of a live stream at the vocoder at once, the rest wait in the stream's send queue
+#define BACKFILL_QUEUE 64
+#define BACKFILL_WINDOW 8 //frames in flight per backfill job
+#define DECODE_WINDOW 32 //the same for --decode, nothing live to leave room for
+#define TXMSG_FILE "txmsg.wav"
+#define TXCACHE_FILE "txmsg.cache" //ambe frames of the prompt, reused while txmsg.wav and the encoder settings stay the same
+#define TXCACHE_WINDOW 8 //frames in flight while encoding the prompt
+#define TXCACHE_SESSION 254 //fifo tag of prompt frames
+#define BACKFILL_SESSION 255 //fifo tag of backfill frames
+#define UDP_BATCH 32
+#define UDP_BATCH_PKTSIZE 512
+#define UDP_RX_BATCHES 4 //batches drained per socket and wakeup, so one busy socket cannot starve the others
+#define NET_QUEUE_SIZE 1024 //packets from the masters to the main loop
+#define TX_QUEUE_SIZE 4 //playback requests to the tx thread
+#define CPU_MAIN -1 //cpu each pipeline stage is pinned to, -1 leaves it to the scheduler
+#define CPU_NET -1
+#define CPU_RECORDER -1
+#define CPU_TX -1
+#define MBE_QUEUE 256 //frames queued to a software decoder channel, more than VOCODER_MAXINFLIGHT
+#define METRICS_PORT 9310 //prometheus text metrics served on 127.0.0.1, 0 disables them
+#define METRICS_BUCKETS 14
 //#define DEBUG
 
 #define SWAP(n) (((n) << 24) | (((n) & 0xff00) << 8) | (((n) >> 8) & 0xff00) | ((n) >> 24))
@@ -160,14 +219,27 @@ const uint32_t ENCODING_TABLE_1676[] =
 	 0xF104U, 0xF377U, 0xF5E1U, 0xF792U, 0xF8CDU, 0xFABEU, 0xFC28U, 0xFE5BU
 };
 
+//output bit of every bptc matrix bit, row by row: the (a * 181) % 196 interleave, with the 68 bit gap
+//left in the burst for the slot type and sync
+const uint16_t BPTC_INTERLEAVE[13U * 15U] = {
+	249U, 234U, 219U, 204U, 189U, 174U,  91U,  76U,  61U,  46U,  31U,  16U,   1U, 250U, 235U,
+	220U, 205U, 190U, 175U,  92U,  77U,  62U,  47U,  32U,  17U,   2U, 251U, 236U, 221U, 206U,
+	191U, 176U,  93U,  78U,  63U,  48U,  33U,  18U,   3U, 252U, 237U, 222U, 207U, 192U, 177U,
+	 94U,  79U,  64U,  49U,  34U,  19U,   4U, 253U, 238U, 223U, 208U, 193U, 178U,  95U,  80U,
+	 65U,  50U,  35U,  20U,   5U, 254U, 239U, 224U, 209U, 194U, 179U,  96U,  81U,  66U,  51U,
+	 36U,  21U,   6U, 255U, 240U, 225U, 210U, 195U, 180U,  97U,  82U,  67U,  52U,  37U,  22U,
+	  7U, 256U, 241U, 226U, 211U, 196U, 181U, 166U,  83U,  68U,  53U,  38U,  23U,   8U, 257U,
+	242U, 227U, 212U, 197U, 182U, 167U,  84U,  69U,  54U,  39U,  24U,   9U, 258U, 243U, 228U,
+	213U, 198U, 183U, 168U,  85U,  70U,  55U,  40U,  25U,  10U, 259U, 244U, 229U, 214U, 199U,
+	184U, 169U,  86U,  71U,  56U,  41U,  26U,  11U, 260U, 245U, 230U, 215U, 200U, 185U, 170U,
+	 87U,  72U,  57U,  42U,  27U,  12U, 261U, 246U, 231U, 216U, 201U, 186U, 171U,  88U,  73U,
+	 58U,  43U,  28U,  13U, 262U, 247U, 232U, 217U, 202U, 187U, 172U,  89U,  74U,  59U,  44U,
+	 29U,  14U, 263U, 248U, 233U, 218U, 203U, 188U, 173U,  90U,  75U,  60U,  45U,  30U,  15U
+};
+
 #define F2(A,B,C) ( ( A & B ) | ( C & ( A | B ) ) )
 #define F1(E,F,G) ( G ^ ( E & ( F ^ G ) ) )
 
-struct sockaddr_in 	host1;
-struct sockaddr_in 	host2;
-int 				udp1;
-int 				udp2;
-fd_set 				udpset; 
 uint8_t 			buf[BUFSIZE];
 char 				callsign[10U];
 int					dmrid;
@@ -175,15 +247,148 @@ uint32_t			sha256_state[8U];
 uint32_t			sha256_total[2];
 uint32_t			sha256_buffer[32U];
 uint32_t			sha256_buflen;
-bool 				bptc_rawData[196];
-bool 				bptc_deInterData[196];
-bool 				emb_raw[128U];
-bool 				emb_data[72U];
-int					tx_srcid;
+int					tx_srcid; //tx_* below are owned by the tx thread
 int					tx_tgid;
 uint8_t 		tx_calltype;
-int					host1_tg;
-char				*host1_pw;
+uint8_t			tx_slot;
+
+typedef struct udp_batch_t {
+	int count;
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	struct sockaddr_in addr[UDP_BATCH];
+	uint8_t data[UDP_BATCH][UDP_BATCH_PKTSIZE];
+} udp_batch;
+
+//latency histogram, written by one thread and read by the metrics thread
+typedef struct histogram_t {
+	uint64_t count[METRICS_BUCKETS + 1]; //per bucket of METRICS_BOUNDS, the last one above them all
+	uint64_t sum; //us
+} histogram;
+
+typedef struct vocoder_fifo_t {
+	int head;
+	int count;
+	uint8_t session[VOCODER_FIFO_SIZE];
+	uint32_t gen[VOCODER_FIFO_SIZE];
+	uint32_t frame[VOCODER_FIFO_SIZE]; //index among the frames its session sent
+	uint16_t after[VOCODER_FIFO_SIZE]; //undecodable frames that followed this one, written as silence after its pcm
+	int64_t sentt[VOCODER_FIFO_SIZE]; //now_us() when queued
+	int64_t waitt; //now_ms() since the head entry is awaited, restarted by every reply
+	uint64_t pushed; //metrics: frames sent and their round trip times
+	histogram rtt;
+} vocoder_fifo;
+
+typedef struct pcm_level_t {
+	int gain; //digital gain after the vocoder, 256 is 0 dB
+	bool agc;
+	int agcgain; //follows the frame peaks, 256 is 0 dB
+} pcm_level;
+
+typedef struct backfill_job_t {
+	bool active;
+	uint32_t gen;
+	char path[4096+100]; //recording path without extension
+	uint8_t *frames; //9 byte ambe frames read from the .ambe file
+	int nframes;
+	int sent;
+	int done;
+	int fifotail; //fifo entry of the last frame sent
+	int wavrec;
+	pcm_level level;
+	int gamma; //decoder gain, see ambe_classify()
+	bool voiced; //a speech frame was sent, silence before it is trimmed
+	int pending; //silence frames since the last speech frame, written once speech follows
+} backfill_job;
+
+struct vocoder_t;
+
+//how a channel is reached: udp to an AMBEServer, or a software decoder in this process.
+//replies come back as AMBEServer packets either way, so the fifo matching and the accounting do not change
+typedef struct vocoder_backend_t {
+	bool (*open)(struct vocoder_t *v);
+	void (*flush)(struct vocoder_t *v); //sends the packets vocoder_send() queued in txq
+	int (*recv)(struct vocoder_t *v, udp_batch *b); //replies ready, as if from v->addr. v->sock is what to wait on
+	bool encodes; //pcm to ambe too, needed for the tx prompt
+} vocoder_backend;
+
+typedef struct vocoder_t {
+	struct sockaddr_in addr;
+	char *url;
+	int port;
+	int sock;
+	const vocoder_backend *backend;
+	struct mbe_worker_t *worker; //software channels only
+	int users; //rx sessions bound to this channel, plus one while encoding tx
+	vocoder_fifo fifo; //ambeserver replies in order, so pcm packets are matched to sessions in send order
+	udp_batch txq; //packets queued during a wakeup, sent with one sendmmsg
+	bool down; //stopped replying, probed on every ping until it answers again
+	int64_t lastsend; //now_ms() of the last packet sent and the last reply
+	int64_t lastrx;
+	backfill_job backfill; //decodes a degraded recording while the channel is idle
+	uint64_t pcmframes; //metrics, written by the main loop only
+	uint64_t ambeframes;
+	uint64_t pcmdrops;
+	uint64_t ambedrops;
+	uint64_t lostframes; //sent and never answered
+} vocoder;
+
+typedef struct master_t {
+	struct sockaddr_in addr;
+	char *url;
+	int port;
+	int tg;
+	char *pw;
+	int sock;
+	int connect_status; //changed through master_set_status() only, read by the metrics thread
+	time_t pong_time;
+	int64_t pingt; //now_us() of the ping not answered yet, 0 when none
+	uint64_t dmrdframes; //metrics, written by the main loop only
+	uint64_t statechanges;
+	histogram pingrtt;
+	bool txpending; //reply to the last call, waits for its slot and for the tx of other masters
+	int64_t tx_startt;
+	int tx_tgid;
+	uint8_t tx_calltype;
+	uint8_t tx_slot;
+} master;
+
+vocoder				vocoders[MAX_VOCODERS];
+int					vocoder_count = 0;
+master				masters[MAX_MASTERS];
+int					master_count = 0;
+master				*tx_master = NULL; //where the active tx goes
+master				*tx_host = NULL; //the same, as seen by the tx thread
+udp_batch			rxbatch;
+char				recpath[4096];
+int64_t				rx_clock_skew = 0; //how far --replay has moved the rx clock ahead of now_ms()
+uint32_t			tx_streamid = 0;
+bool				txactive = false; //set by the main loop when a request is queued, cleared once the tx thread reports the end
+int					txdonefd; //eventfd, kicked by the tx thread at the end of every playback
+int					tx_ambefcnt = 0;
+uint8_t				tx_ambefr[3][9];
+
+typedef struct dmrids_entry_t {
+	uint32_t id;
+	uint32_t callsign; //offset of the callsign string in the pool
+} dmrids_entry;
+
+typedef struct dmrids_index_t {
+	dmrids_entry *entries; //sorted by id
+	int count;
+	char *pool; //nul terminated callsigns
+	time_t mtime;
+	ino_t ino;
+	off_t size;
+} dmrids_index;
+
+dmrids_index		*dmrids = NULL;
+dmrids_index		*dmrids_pending = NULL; //set by the loader thread, picked up by the main loop
+pthread_mutex_t		dmrids_mutex = PTHREAD_MUTEX_INITIALIZER;
+bool				dmrids_loading = false;
+uint64_t			dmrids_lookups = 0;
+uint64_t			dmrids_hits = 0;
+int					dmrids_loadms = 0;
 
 
 static const unsigned char fillbuf[64] = { 0x80, 0 };
@@ -205,36 +410,306 @@ static const unsigned char fillbuf[64] = { 0x80, 0 };
 #define MMDVM_SLOTTYPE_HEADER        1
 #define MMDVM_SLOTTYPE_TERMINATOR    2
 
-void byteToBitsBE(unsigned char byte, bool* bits)
+// dmrd frame layout
+#define DMRD_LEN		55
+#define DMRD_SEQ		4
+#define DMRD_SRCID		5
+#define DMRD_DSTID		8
+#define DMRD_RPTID		11
+#define DMRD_FLAGS		15
+#define DMRD_STREAMID	16
+#define DMRD_DATA		20
+
+//a received dmrd frame, fields decoded with byte loads so any packet alignment is fine, the payload is not copied
+typedef struct dmrd_view_t {
+	uint8_t seq;
+	uint32_t srcid;
+	uint32_t dstid;
+	uint32_t rptid;
+	uint8_t slot; //0: slot1, 1: slot2
+	uint8_t calltype; //0: group call, 1: private call
+	uint8_t frametype;
+	uint8_t n; //slot type of data sync frames, position in the superframe of voice frames
+	uint32_t streamid; //in packet byte order, only compared and echoed
+	const uint8_t *data; //33 byte burst
+} dmrd_view;
+
+//constant fields of an outgoing stream, stamped once, copied into every frame
+typedef struct dmrd_builder_t {
+	uint8_t frame[DMRD_LEN];
+} dmrd_builder;
+
+static inline uint32_t load24(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+}
+
+static inline uint32_t load32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void store24(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 16;
+	p[1] = v >> 8;
+	p[2] = v;
+}
+
+static inline void store32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+bool dmrd_parse(const uint8_t *pkt, int len, dmrd_view *v)
+{
+	if ( (len != DMRD_LEN) || (memcmp(pkt, "DMRD", 4U) != 0) )
+		return false;
+	v->seq = pkt[DMRD_SEQ];
+	v->srcid = load24(&pkt[DMRD_SRCID]);
+	v->dstid = load24(&pkt[DMRD_DSTID]);
+	v->rptid = load32(&pkt[DMRD_RPTID]);
+	v->slot = (pkt[DMRD_FLAGS] & 0x80) >> 7;
+	v->calltype = (pkt[DMRD_FLAGS] & 0x40) >> 6;
+	v->frametype = (pkt[DMRD_FLAGS] & 0x30) >> 4;
+	v->n = pkt[DMRD_FLAGS] & 0x0F;
+	memcpy(&v->streamid, &pkt[DMRD_STREAMID], 4);
+	v->data = &pkt[DMRD_DATA];
+	return true;
+}
+
+//the three 72 bit ambe frames of a voice burst, the middle one split around the sync or emb field
+void dmrd_get_ambe(const uint8_t *data, uint8_t *ambe)
+{
+	memcpy(&ambe[0], &data[0], 9);
+	memcpy(&ambe[9], &data[9], 4);
+	ambe[13] = (data[13] & 0xF0) | (data[19] & 0x0F);
+	memcpy(&ambe[14], &data[20], 4);
+	memcpy(&ambe[18], &data[24], 9);
+}
+
+//data must hold the sync or emb field already, its nibbles in bytes 13 and 19 are kept
+void dmrd_put_ambe(uint8_t *data, const uint8_t *ambe)
+{
+	memcpy(&data[0], &ambe[0], 9);
+	memcpy(&data[9], &ambe[9], 4);
+	data[13] = (data[13] & 0x0F) | (ambe[13] & 0xF0);
+	data[19] = (data[19] & 0xF0) | (ambe[13] & 0x0F);
+	memcpy(&data[20], &ambe[14], 4);
+	memcpy(&data[24], &ambe[18], 9);
+}
+
+void dmrd_builder_init(dmrd_builder *b, uint32_t srcid, uint32_t dstid, uint32_t rptid, uint8_t slot, uint8_t calltype, uint32_t streamid)
+{
+	memset(b->frame, 0, DMRD_LEN);
+	memcpy(b->frame, "DMRD", 4);
+	store24(&b->frame[DMRD_SRCID], srcid);
+	store24(&b->frame[DMRD_DSTID], dstid);
+	store32(&b->frame[DMRD_RPTID], rptid);
+	b->frame[DMRD_FLAGS] = (slot << 7) | (calltype << 6);
+	memcpy(&b->frame[DMRD_STREAMID], &streamid, 4);
+}
+
+//frame with the stream fields, sequence number and frame type set, empty burst
+void dmrd_build(const dmrd_builder *b, uint8_t *pkt, uint8_t seq, uint8_t frametype, uint8_t n)
+{
+	memcpy(pkt, b->frame, DMRD_LEN);
+	pkt[DMRD_SEQ] = seq;
+	pkt[DMRD_FLAGS] |= (frametype << 4) | n;
+}
+
+//source id sent on the air, 9 digit hotspot ids drop their suffix
+uint32_t dmr_srcid()
+{
+	return (dmrid > 99999999) ? dmrid / 100 : dmrid;
+}
+
+int64_t now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int64_t now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//the clock rx hang times run on, now_ms() unless a replay runs the stream faster than real time
+int64_t rx_clock_ms()
+{
+	return now_ms() + rx_clock_skew;
+}
+
+void rx_clock_advance(int64_t t)
+{
+	if (t > rx_clock_ms())
+		rx_clock_skew = t - now_ms();
+}
+
+const uint32_t		METRICS_BOUNDS[METRICS_BUCKETS] = {100U, 250U, 500U, 1000U, 2500U, 5000U, 10000U, 25000U, 50000U, 100000U, 250000U, 500000U, 1000000U, 2500000U}; //us
+
+//metrics are only written by the thread that owns them, plain increments published with relaxed stores
+static inline void counter_add(uint64_t *c, uint64_t n)
 {
-	bits[0U] = (byte & 0x80U) == 0x80U;
-	bits[1U] = (byte & 0x40U) == 0x40U;
-	bits[2U] = (byte & 0x20U) == 0x20U;
-	bits[3U] = (byte & 0x10U) == 0x10U;
-	bits[4U] = (byte & 0x08U) == 0x08U;
-	bits[5U] = (byte & 0x04U) == 0x04U;
-	bits[6U] = (byte & 0x02U) == 0x02U;
-	bits[7U] = (byte & 0x01U) == 0x01U;
+	__atomic_store_n(c, *c + n, __ATOMIC_RELAXED);
 }
 
-void bitsToByteBE(bool* bits, unsigned char* byte)
+void histogram_add(histogram *h, int64_t us)
 {
-	*byte  = bits[0U] ? 0x80U : 0x00U;
-	*byte |= bits[1U] ? 0x40U : 0x00U;
-	*byte |= bits[2U] ? 0x20U : 0x00U;
-	*byte |= bits[3U] ? 0x10U : 0x00U;
-	*byte |= bits[4U] ? 0x08U : 0x00U;
-	*byte |= bits[5U] ? 0x04U : 0x00U;
-	*byte |= bits[6U] ? 0x02U : 0x00U;
-	*byte |= bits[7U] ? 0x01U : 0x00U;
+	int i = 0;
+	while ( (i < METRICS_BUCKETS) && (us > METRICS_BOUNDS[i]) )
+		i++;
+	counter_add(&h->count[i], 1);
+	counter_add(&h->sum, us);
 }
 
-int max(int x, int y) 
-{ 
-    if (x > y) 
-        return x; 
-    else
-        return y; 
+void master_set_status(master *m, int status)
+{
+	if (status == m->connect_status)
+		return;
+	__atomic_store_n(&m->connect_status, status, __ATOMIC_RELAXED);
+	counter_add(&m->statechanges, 1);
+}
+
+void timer_arm(int fd, int64_t at_ms, int interval_ms)
+{
+	//absolute CLOCK_MONOTONIC deadline, at_ms == 0 disarms the timer
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = at_ms / 1000;
+	its.it_value.tv_nsec = (at_ms % 1000) * 1000000;
+	its.it_interval.tv_sec = interval_ms / 1000;
+	its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+	timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+uint64_t timer_expirations(int fd)
+{
+	uint64_t n = 0;
+	if (read(fd, &n, sizeof(n)) != sizeof(n))
+		return 0;
+	return n;
+}
+
+void epoll_add(int epfd, int fd)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+		perror("epoll_ctl");
+}
+
+//lock-free single producer, single consumer ring between two pipeline stages.
+//the producer fills the slot at tail and publishes it, the consumer works on the entry at head and releases it.
+//head and tail only grow, their difference is the depth.
+typedef struct spsc_ring_t {
+	uint32_t head __attribute__((aligned(64))); //written by the consumer only
+	uint32_t tail __attribute__((aligned(64))); //written by the producer only
+	uint32_t size __attribute__((aligned(64))); //entries, a power of two
+	uint32_t esize;
+	uint8_t *entries;
+	int efd; //eventfd the consumer sleeps on, kicked by the producer after a batch
+	uint32_t unkicked; //producer side
+	uint32_t maxdepth; //counters, written by the producer, read anywhere
+	uint32_t drops;
+	const char *name;
+} spsc_ring;
+
+spsc_ring			net_ring; //net thread to main loop
+spsc_ring			recorder_ring; //main loop to writer thread
+spsc_ring			tx_ring; //main loop to tx thread
+
+bool spsc_init(spsc_ring *r, const char *name, uint32_t size, uint32_t esize)
+{
+	memset(r, 0, sizeof(spsc_ring));
+	r->name = name;
+	r->size = size;
+	r->esize = esize;
+	r->entries = calloc(size, esize);
+	r->efd = eventfd(0, EFD_NONBLOCK);
+	return (r->entries != NULL) && (r->efd != -1);
+}
+
+uint32_t spsc_depth(spsc_ring *r)
+{
+	uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - head;
+}
+
+//producer: entry to fill, NULL (counted as a drop) when fewer than reserve entries would be left
+void *spsc_slot(spsc_ring *r, uint32_t reserve)
+{
+	if (r->tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) + reserve >= r->size) {
+		__atomic_store_n(&r->drops, r->drops + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	return r->entries + (size_t)(r->tail & (r->size - 1)) * r->esize;
+}
+
+void spsc_push(spsc_ring *r)
+{
+	__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+	uint32_t depth = r->tail - __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	if (depth > r->maxdepth)
+		__atomic_store_n(&r->maxdepth, depth, __ATOMIC_RELAXED);
+	r->unkicked++;
+}
+
+//producer: wake the consumer once for everything pushed since the last kick
+void spsc_kick(spsc_ring *r)
+{
+	if (r->unkicked == 0)
+		return;
+	r->unkicked = 0;
+	eventfd_write(r->efd, 1);
+}
+
+//consumer: oldest entry, NULL when empty. it stays owned by the consumer until spsc_pop()
+void *spsc_peek(spsc_ring *r)
+{
+	if (r->head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return r->entries + (size_t)(r->head & (r->size - 1)) * r->esize;
+}
+
+void spsc_pop(spsc_ring *r)
+{
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+//consumer: clear the kick before draining, so a kick that comes in while draining is not lost
+void spsc_ack(spsc_ring *r)
+{
+	eventfd_t n;
+	eventfd_read(r->efd, &n);
+}
+
+//consumer: sleep until the producer kicks
+void spsc_wait(spsc_ring *r)
+{
+	struct pollfd p = { r->efd, POLLIN, 0 };
+	poll(&p, 1, -1);
+	spsc_ack(r);
+}
+
+void stage_pin(const char *name, int cpu)
+{
+	if (cpu < 0)
+		return;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+		fprintf(stderr, "failed to pin %s stage to cpu %d\n", name, cpu);
 }
 
 static inline void set_uint32(unsigned char* cp, uint32_t v)
@@ -245,7 +720,7 @@ static inline void set_uint32(unsigned char* cp, uint32_t v)
 void process_signal(int sig)
 {
 	uint8_t b[20];
-	if(sig == SIGINT){
+	if( (sig == SIGINT) || (sig == SIGTERM) ){
 		fprintf(stderr, "\n\nShutting down link\n");
 		b[0] = 'R';
 		b[1] = 'P';
@@ -256,160 +731,88 @@ void process_signal(int sig)
 		b[6] = (dmrid >> 16) & 0xff;
 		b[7] = (dmrid >> 8) & 0xff;
 		b[8] = (dmrid >> 0) & 0xff;
-		sendto(udp1, b, 9, 0, (const struct sockaddr *)&host1, sizeof(host1));
+		for (int i = 0; i < master_count; i++) {
+			sendto(masters[i].sock, b, 9, 0, (const struct sockaddr *)&masters[i].addr, sizeof(masters[i].addr));
 #ifdef DEBUG
-		fprintf(stderr, "SEND DMR: ");
-		for(int i = 0; i < 9; ++i)
-			fprintf(stderr, "%02x ", b[i]);
-		fprintf(stderr, "\n");
+			fprintf(stderr, "SEND DMR: ");
+			for(int k = 0; k < 9; ++k)
+				fprintf(stderr, "%02x ", b[k]);
+			fprintf(stderr, "\n");
 #endif
-		close(udp1);
-		close(udp2);
+			close(masters[i].sock);
+		}
+		for (int i = 0; i < vocoder_count; i++)
+			close(vocoders[i].sock);
 		exit(EXIT_SUCCESS);
 	}
-	if(sig == SIGALRM){
+}
+
+void send_ping(master *m)
+{
+	uint8_t b[20];
+	{
 		char tag[] = { 'R','P','T','P','I','N','G' };
 		memcpy(b, tag, 7);
 		b[7] = (dmrid >> 24) & 0xff;
 		b[8] = (dmrid >> 16) & 0xff;
 		b[9] = (dmrid >> 8) & 0xff;
 		b[10] = (dmrid >> 0) & 0xff;
-		sendto(udp1, b, 11, 0, (const struct sockaddr *)&host1, sizeof(host1));
+		sendto(m->sock, b, 11, 0, (const struct sockaddr *)&m->addr, sizeof(m->addr));
+		m->pingt = now_us();
 #ifdef DEBUG
 		fprintf(stderr, "SEND DMR: ");
 		for(int i = 0; i < 11; ++i)
 			fprintf(stderr, "%02x ", b[i]);
 		fprintf(stderr, "\n");
 #endif
-		alarm(5);
 	}
 }
 
-void hamming_encode15113_2(bool* d)
-{
-    d[11] = d[0] ^ d[1] ^ d[2] ^ d[3] ^ d[5] ^ d[7] ^ d[8];
-    d[12] = d[1] ^ d[2] ^ d[3] ^ d[4] ^ d[6] ^ d[8] ^ d[9];
-    d[13] = d[2] ^ d[3] ^ d[4] ^ d[5] ^ d[7] ^ d[9] ^ d[10];
-    d[14] = d[0] ^ d[1] ^ d[2] ^ d[4] ^ d[6] ^ d[7] ^ d[10];
-}
-
-void hamming_encode1393(bool* d)
+unsigned int parity16(uint16_t x)
 {
-    d[9]  = d[0] ^ d[1] ^ d[3] ^ d[5] ^ d[6];
-    d[10] = d[0] ^ d[1] ^ d[2] ^ d[4] ^ d[6] ^ d[7];
-    d[11] = d[0] ^ d[1] ^ d[2] ^ d[3] ^ d[5] ^ d[7] ^ d[8];
-    d[12] = d[0] ^ d[2] ^ d[4] ^ d[5] ^ d[8];
+	x ^= x >> 8;
+	x ^= x >> 4;
+	x ^= x >> 2;
+	x ^= x >> 1;
+	return x & 1U;
 }
 
+//BPTC(196,96) of 12 bytes into the 33 byte burst, the slot type bits in out[12] and out[20] are kept.
+//the matrix is held as 13 rows of 15 bits, column 0 in the msb, so columns are encoded a whole row at a time.
 void bptc_encode(const unsigned char* in, unsigned char* out)
 {
-	//Extract
-    bool bData[96U];
-	byteToBitsBE(in[0U],  bData + 0U);
-	byteToBitsBE(in[1U],  bData + 8U);
-	byteToBitsBE(in[2U],  bData + 16U);
-	byteToBitsBE(in[3U],  bData + 24U);
-	byteToBitsBE(in[4U],  bData + 32U);
-	byteToBitsBE(in[5U],  bData + 40U);
-	byteToBitsBE(in[6U],  bData + 48U);
-	byteToBitsBE(in[7U],  bData + 56U);
-	byteToBitsBE(in[8U],  bData + 64U);
-	byteToBitsBE(in[9U],  bData + 72U);
-	byteToBitsBE(in[10U], bData + 80U);
-	byteToBitsBE(in[11U], bData + 88U);
-    
-    for (unsigned int i = 0U; i < 196U; i++)
-        bptc_deInterData[i] = false;
-    
-    unsigned int pos = 0U;
-    for (unsigned int a = 4U; a <= 11U; a++, pos++)
-        bptc_deInterData[a] = bData[pos];
-    
-    for (unsigned int a = 16U; a <= 26U; a++, pos++)
-        bptc_deInterData[a] = bData[pos];
-    
-    for (unsigned int a = 31U; a <= 41U; a++, pos++)
-        bptc_deInterData[a] = bData[pos];
-    
-    for (unsigned int a = 46U; a <= 56U; a++, pos++)
-        bptc_deInterData[a] = bData[pos];
-    
-    for (unsigned int a = 61U; a <= 71U; a++, pos++)
-        bptc_deInterData[a] = bData[pos];
-    
-    for (unsigned int a = 76U; a <= 86U; a++, pos++)
-        bptc_deInterData[a] = bData[pos];
-    
-    for (unsigned int a = 91U; a <= 101U; a++, pos++)
-        bptc_deInterData[a] = bData[pos];
-    
-    for (unsigned int a = 106U; a <= 116U; a++, pos++)
-        bptc_deInterData[a] = bData[pos];
-    
-    for (unsigned int a = 121U; a <= 131U; a++, pos++)
-        bptc_deInterData[a] = bData[pos];
-        
-    //Error check
-    for (unsigned int r = 0U; r < 9U; r++) {
-        unsigned int pos = (r * 15U) + 1U;
-        hamming_encode15113_2(bptc_deInterData + pos);
-    }
-    
-    bool col[13U];
-    for (unsigned int c = 0U; c < 15U; c++) {
-        unsigned int pos = c + 1U;
-        for (unsigned int a = 0U; a < 13U; a++) {
-            col[a] = bptc_deInterData[pos];
-            pos = pos + 15U;
-        }
-        
-        hamming_encode1393(col);
-        
-        pos = c + 1U;
-        for (unsigned int a = 0U; a < 13U; a++) {
-            bptc_deInterData[pos] = col[a];
-            pos = pos + 15U;
-        }
-    }
-    //Interleave
-    for (unsigned int i = 0U; i < 196U; i++)
-        bptc_rawData[i] = false;
-    
-    for (unsigned int a = 0U; a < 196U; a++)	{
-        unsigned int interleaveSequence = (a * 181U) % 196U;
-        bptc_rawData[interleaveSequence] = bptc_deInterData[a];
-    }
-    //Extract
-    bitsToByteBE(bptc_rawData + 0U,  &out[0U]);
-	bitsToByteBE(bptc_rawData + 8U,  &out[1U]);
-	bitsToByteBE(bptc_rawData + 16U, &out[2U]);
-	bitsToByteBE(bptc_rawData + 24U, &out[3U]);
-	bitsToByteBE(bptc_rawData + 32U, &out[4U]);
-	bitsToByteBE(bptc_rawData + 40U, &out[5U]);
-	bitsToByteBE(bptc_rawData + 48U, &out[6U]);
-	bitsToByteBE(bptc_rawData + 56U, &out[7U]);
-	bitsToByteBE(bptc_rawData + 64U, &out[8U]);
-	bitsToByteBE(bptc_rawData + 72U, &out[9U]);
-	bitsToByteBE(bptc_rawData + 80U, &out[10U]);
-	bitsToByteBE(bptc_rawData + 88U, &out[11U]);
-    
-    unsigned char byte;
-	bitsToByteBE(bptc_rawData + 96U, &byte);
-    out[12U] = (out[12U] & 0x3FU) | ((byte >> 0) & 0xC0U);
-    out[20U] = (out[20U] & 0xFCU) | ((byte >> 4) & 0x03U);
-    
-	bitsToByteBE(bptc_rawData + 100U,  &out[21U]);
-	bitsToByteBE(bptc_rawData + 108U,  &out[22U]);
-	bitsToByteBE(bptc_rawData + 116U,  &out[23U]);
-	bitsToByteBE(bptc_rawData + 124U,  &out[24U]);
-	bitsToByteBE(bptc_rawData + 132U,  &out[25U]);
-	bitsToByteBE(bptc_rawData + 140U,  &out[26U]);
-	bitsToByteBE(bptc_rawData + 148U,  &out[27U]);
-	bitsToByteBE(bptc_rawData + 156U,  &out[28U]);
-	bitsToByteBE(bptc_rawData + 164U,  &out[29U]);
-	bitsToByteBE(bptc_rawData + 172U,  &out[30U]);
-	bitsToByteBE(bptc_rawData + 180U,  &out[31U]);
-	bitsToByteBE(bptc_rawData + 188U,  &out[32U]);
+	uint16_t rows[13U];
+	rows[0U] = in[0U] << 4; //columns 0-2 of the first row are reserved
+	for (unsigned int r = 1U; r < 9U; r++) {
+		unsigned int bit = 8U + (r - 1U) * 11U;
+		uint32_t window = (in[bit / 8U] << 16) | (in[bit / 8U + 1U] << 8) | ((bit / 8U + 2U < 12U) ? in[bit / 8U + 2U] : 0U);
+		rows[r] = ((window >> (13U - (bit % 8U))) & 0x7FFU) << 4;
+	}
+	
+	//Hamming(15,11,3) on rows
+	for (unsigned int r = 0U; r < 9U; r++) {
+		uint16_t d = rows[r];
+		rows[r] |= (parity16(d & 0x7AC0U) << 3) | (parity16(d & 0x3D60U) << 2) | (parity16(d & 0x1EB0U) << 1) | parity16(d & 0x7590U);
+	}
+	
+	//Hamming(13,9,4) on columns
+	rows[9U]  = rows[0U] ^ rows[1U] ^ rows[3U] ^ rows[5U] ^ rows[6U];
+	rows[10U] = rows[0U] ^ rows[1U] ^ rows[2U] ^ rows[4U] ^ rows[6U] ^ rows[7U];
+	rows[11U] = rows[0U] ^ rows[1U] ^ rows[2U] ^ rows[3U] ^ rows[5U] ^ rows[7U] ^ rows[8U];
+	rows[12U] = rows[0U] ^ rows[2U] ^ rows[4U] ^ rows[5U] ^ rows[8U];
+	
+	//Interleave
+	memset(out, 0, 12U);
+	out[12U] &= 0x3FU;
+	out[20U] &= 0xFCU;
+	memset(out + 21U, 0, 12U);
+	const uint16_t *pos = BPTC_INTERLEAVE;
+	for (unsigned int r = 0U; r < 13U; r++) {
+		for (int c = 14; c >= 0; c--, pos++) {
+			if ((rows[r] >> c) & 1U)
+				out[*pos >> 3] |= 0x80U >> (*pos & 7U);
+		}
+	}
 }
 
 unsigned char rs129_gmult(unsigned char a, unsigned char b)
@@ -423,7 +826,7 @@ unsigned char rs129_gmult(unsigned char a, unsigned char b)
     return EXP_TABLE[i + j];
 }
 
-void generate_header()
+void generate_header(uint8_t *pkt)
 {
 	uint8_t sync_ms_data[]     = { 0x0D,0x5D,0x7F,0x77,0xFD,0x75,0x70 };
 	uint8_t payload[33];
@@ -434,17 +837,17 @@ void generate_header()
 	{
 		memset(lc, 0, sizeof(lc));
 
-		if ((buf[15] & 0x40U) == 0x40U)
+		if ((pkt[15] & 0x40U) == 0x40U)
 			lc[0U] |= 0x03U; //FLCO_USER_USER
 
 		//DESTID/TGID
-		lc[3] = buf[8];		
-		lc[4] = buf[9];
-		lc[5] = buf[10];
+		lc[3] = pkt[8];		
+		lc[4] = pkt[9];
+		lc[5] = pkt[10];
 		//SRCID
-		lc[6] = buf[5];
-		lc[7] = buf[6];
-		lc[8] = buf[7];
+		lc[6] = pkt[5];
+		lc[7] = pkt[6];
+		lc[8] = pkt[7];
 
 		uint8_t parity[4];
 		
@@ -483,7 +886,7 @@ void generate_header()
 
 	}
 	bptc_encode(lc, payload);
-	memcpy(buf + 20, payload, 33);
+	memcpy(pkt + 20, payload, 33);
 }
 
 void sha256_process_block(const unsigned char* buffer, unsigned int len)
@@ -678,60 +1081,35 @@ void sha256_generate(char *in, int len, char *out)
 		set_uint32(out + i * sizeof(sha256_state[0]), SWAP(sha256_state[i]));
 }
 
-void lc_get_data(uint8_t *bytes)
+//full link control of a voice call: flco, feature set id 0, no service options, destination and source
+void lc_build(uint8_t *lc, uint8_t calltype, int dstid, int srcid)
 {
-	bool pf, r;
-	uint8_t fid, options;
-	pf = (bytes[0U] & 0x80U) == 0x80U;
-	r  = (bytes[0U] & 0x40U) == 0x40U;
-	fid = bytes[1U];
-	options = bytes[2U];
-
-	bytes[0U] = 0;
-
-	if (tx_calltype == 1)
-		bytes[0U] |= 0x03U; //FLCO_USER_USER
-
-	if (pf)
-		bytes[0U] |= 0x80U;
-
-	if (r)
-		bytes[0U] |= 0x40U;
-
-	bytes[1U] = fid;
-	bytes[2U] = options;
-	bytes[3U] = tx_tgid >> 16;
-	bytes[4U] = tx_tgid >> 8;
-	bytes[5U] = tx_tgid >> 0;
-	bytes[6U] = tx_srcid >> 16;
-	bytes[7U] = tx_srcid >> 8;
-	bytes[8U] = tx_srcid >> 0;
+	memset(lc, 0, 9);
+	if (calltype == 1)
+		lc[0U] |= 0x03U; //FLCO_USER_USER
+	lc[3U] = dstid >> 16;
+	lc[4U] = dstid >> 8;
+	lc[5U] = dstid >> 0;
+	lc[6U] = srcid >> 16;
+	lc[7U] = srcid >> 8;
+	lc[8U] = srcid >> 0;
 }
 
-void lc_get_data_bits(bool* bits)
-{
-	uint8_t bytes[9U];
-	memset(bytes, 0, 9);
-	lc_get_data(bytes);
-
-	byteToBitsBE(bytes[0U], bits + 0U);
-	byteToBitsBE(bytes[1U], bits + 8U);
-	byteToBitsBE(bytes[2U], bits + 16U);
-	byteToBitsBE(bytes[3U], bits + 24U);
-	byteToBitsBE(bytes[4U], bits + 32U);
-	byteToBitsBE(bytes[5U], bits + 40U);
-	byteToBitsBE(bytes[6U], bits + 48U);
-	byteToBitsBE(bytes[7U], bits + 56U);
-	byteToBitsBE(bytes[8U], bits + 64U);
-}
+//Hamming(16,11,4) parity of 11 data bits, split in the first 6 and the last 5
+const uint8_t HAMMING16114_HI[64] = {
+	0x00U, 0x15U, 0x0EU, 0x1BU, 0x1CU, 0x09U, 0x12U, 0x07U, 0x1FU, 0x0AU, 0x11U, 0x04U, 0x03U, 0x16U, 0x0DU, 0x18U,
+	0x1AU, 0x0FU, 0x14U, 0x01U, 0x06U, 0x13U, 0x08U, 0x1DU, 0x05U, 0x10U, 0x0BU, 0x1EU, 0x19U, 0x0CU, 0x17U, 0x02U,
+	0x13U, 0x06U, 0x1DU, 0x08U, 0x0FU, 0x1AU, 0x01U, 0x14U, 0x0CU, 0x19U, 0x02U, 0x17U, 0x10U, 0x05U, 0x1EU, 0x0BU,
+	0x09U, 0x1CU, 0x07U, 0x12U, 0x15U, 0x00U, 0x1BU, 0x0EU, 0x16U, 0x03U, 0x18U, 0x0DU, 0x0AU, 0x1FU, 0x04U, 0x11U
+};
+const uint8_t HAMMING16114_LO[32] = {
+	0x00U, 0x07U, 0x0DU, 0x0AU, 0x19U, 0x1EU, 0x14U, 0x13U, 0x16U, 0x11U, 0x1BU, 0x1CU, 0x0FU, 0x08U, 0x02U, 0x05U,
+	0x0BU, 0x0CU, 0x06U, 0x01U, 0x12U, 0x15U, 0x1FU, 0x18U, 0x1DU, 0x1AU, 0x10U, 0x17U, 0x04U, 0x03U, 0x09U, 0x0EU
+};
 
-void encode16114(bool* d)
+uint16_t hamming16114_encode(uint16_t d)
 {
-	d[11] = d[0] ^ d[1] ^ d[2] ^ d[3] ^ d[5] ^ d[7] ^ d[8];
-	d[12] = d[1] ^ d[2] ^ d[3] ^ d[4] ^ d[6] ^ d[8] ^ d[9];
-	d[13] = d[2] ^ d[3] ^ d[4] ^ d[5] ^ d[7] ^ d[9] ^ d[10];
-	d[14] = d[0] ^ d[1] ^ d[2] ^ d[4] ^ d[6] ^ d[7] ^ d[10];
-	d[15] = d[0] ^ d[2] ^ d[5] ^ d[6] ^ d[8] ^ d[9] ^ d[10];
+	return (d << 5) | (HAMMING16114_HI[d >> 5] ^ HAMMING16114_LO[d & 0x1FU]);
 }
 
 void encode_qr1676(uint8_t* data)
@@ -743,94 +1121,66 @@ void encode_qr1676(uint8_t* data)
 	data[1U] = cksum & 0xFFU;
 }
 
-void encode_embedded_data()
+//embedded lc of a superframe, as the four 32 bit fragments carried by voice frames B to E.
+//the 8x16 matrix is held as rows with column 0 in the msb.
+void emb_lc_encode(const uint8_t *lc, uint32_t *frag)
 {
-	uint32_t crc;
-	unsigned short total = 0U;
+	uint8_t bytes[12U];
+	memset(bytes, 0, sizeof(bytes));
+	memcpy(bytes, lc, 9U);
 	
-	lc_get_data_bits(emb_data);
+	unsigned int crc = 0U; //5 bit checksum
+	for (unsigned int i = 0U; i < 9U; i++)
+		crc += lc[i];
+	crc %= 31U;
 	
-	for (unsigned int i = 0U; i < 72U; i += 8U) {
-		unsigned char c;
-		bitsToByteBE(emb_data + i, &c);
-		total += c;
+	//rows 0-1 carry 11 lc bits, rows 2-6 carry 10 lc bits and one checksum bit
+	uint16_t rows[8U];
+	unsigned int bit = 0U;
+	for (unsigned int r = 0U; r < 7U; r++) {
+		unsigned int n = (r < 2U) ? 11U : 10U;
+		uint32_t window = (bytes[bit / 8U] << 16) | (bytes[bit / 8U + 1U] << 8) | bytes[bit / 8U + 2U];
+		uint16_t d = (window >> (24U - n - (bit % 8U))) & ((1U << n) - 1U);
+		if (r >= 2U)
+			d = (d << 1) | ((crc >> (6U - r)) & 1U);
+		rows[r] = hamming16114_encode(d);
+		bit += n;
 	}
-
-	total %= 31U;
-	crc = total;
-
-	bool data[128U];
-	memset(data, 0x00U, 128U * sizeof(bool));
-
-	data[106U] = (crc & 0x01U) == 0x01U;
-	data[90U]  = (crc & 0x02U) == 0x02U;
-	data[74U]  = (crc & 0x04U) == 0x04U;
-	data[58U]  = (crc & 0x08U) == 0x08U;
-	data[42U]  = (crc & 0x10U) == 0x10U;
-
-	uint32_t b = 0U;
-	for (uint32_t a = 0U; a < 11U; a++, b++)
-		data[a] = emb_data[b];
-		
-	for (uint32_t a = 16U; a < 27U; a++, b++)
-		data[a] = emb_data[b];
-		
-	for (uint32_t a = 32U; a < 42U; a++, b++)
-		data[a] = emb_data[b];
-		
-	for (uint32_t a = 48U; a < 58U; a++, b++)
-		data[a] = emb_data[b];
-		
-	for (uint32_t a = 64U; a < 74U; a++, b++)
-		data[a] = emb_data[b];
-		
-	for (uint32_t a = 80U; a < 90U; a++, b++)
-		data[a] = emb_data[b];
-		
-	for (uint32_t a = 96U; a < 106U; a++, b++)
-		data[a] = emb_data[b];
-		
-	for (uint32_t a = 0U; a < 112U; a += 16U)
-		encode16114(data + a);
-		
-	for (uint32_t a = 0U; a < 16U; a++)
-		data[a + 112U] = data[a + 0U] ^ data[a + 16U] ^ data[a + 32U] ^ data[a + 48U] ^ data[a + 64U] ^ data[a + 80U] ^ data[a + 96U];
-
-	b = 0U;
-	for (uint32_t a = 0U; a < 128U; a++) {
-		emb_raw[a] = data[b];
-		b += 16U;
-		if (b > 127U)
-			b -= 127U;
+	rows[7U] = rows[0U] ^ rows[1U] ^ rows[2U] ^ rows[3U] ^ rows[4U] ^ rows[5U] ^ rows[6U]; //column parity
+	
+	//Interleave: fragment bit a is matrix bit (a * 16) % 127, which makes byte c of the fragments column c
+	//of the matrix. transpose both 8x8 halves in a 64 bit word, row 0 in the top byte
+	for (unsigned int half = 0U; half < 2U; half++) {
+		uint64_t x = 0U;
+		for (unsigned int r = 0U; r < 8U; r++)
+			x = (x << 8) | ((rows[r] >> (8U - half * 8U)) & 0xFFU);
+		uint64_t t;
+		t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+		x = x ^ t ^ (t << 7);
+		t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+		x = x ^ t ^ (t << 14);
+		t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+		x = x ^ t ^ (t << 28);
+		frag[half * 2U] = x >> 32;
+		frag[half * 2U + 1U] = x & 0xFFFFFFFFU;
 	}
 }
 
-uint8_t get_embedded_data(uint8_t* data, uint8_t n)
+//embedded signalling of voice frame n (0-5) of a superframe, returns its lcss
+uint8_t emb_lc_put(uint8_t* data, const uint32_t *frag, uint8_t n)
 {
 	if (n >= 1U && n < 5U) {
-		n--;
-
-		bool bits[40U];
-		memset(bits, 0x00U, 40U * sizeof(bool));
-		memcpy(bits + 4U, emb_raw + n * 32U, 32U * sizeof(bool));
-
-		uint8_t bytes[5U];
-		bitsToByteBE(bits + 0U,  &bytes[0U]);
-		bitsToByteBE(bits + 8U,  &bytes[1U]);
-		bitsToByteBE(bits + 16U, &bytes[2U]);
-		bitsToByteBE(bits + 24U, &bytes[3U]);
-		bitsToByteBE(bits + 32U, &bytes[4U]);
-
-		data[14U] = (data[14U] & 0xF0U) | (bytes[0U] & 0x0FU);
-		data[15U] = bytes[1U];
-		data[16U] = bytes[2U];
-		data[17U] = bytes[3U];
-		data[18U] = (data[18U] & 0x0FU) | (bytes[4U] & 0xF0U);
+		uint32_t f = frag[n - 1U];
+		data[14U] = (data[14U] & 0xF0U) | ((f >> 28) & 0x0FU);
+		data[15U] = f >> 20;
+		data[16U] = f >> 12;
+		data[17U] = f >> 4;
+		data[18U] = (data[18U] & 0x0FU) | ((f << 4) & 0xF0U);
 
 		switch (n) {
-		case 0U:
+		case 1U:
 			return 1U;
-		case 3U:
+		case 4U:
 			return 2U;
 		default:
 			return 3U;
@@ -863,7 +1213,270 @@ void get_emb_data(uint8_t* data, uint8_t lcss)
 	data[19U] = (data[19U] & 0x0FU) | ((DMREMB[1U] << 4U) & 0xF0U);
 }
 
-int process_connect(int connect_status, char *buf)
+//ambe+2 frame as carried in a dmr burst: dibit i holds bit AMBE_W[i]/AMBE_X[i] of vector C0-C3, then bit AMBE_Y[i]/AMBE_Z[i]
+const uint8_t AMBE_W[36] = {0,1,0,1,0,1, 0,1,0,1,0,1, 0,1,0,1,0,1, 0,1,0,1,0,2, 0,2,0,2,0,2, 0,2,0,2,0,2};
+const uint8_t AMBE_X[36] = {23,10,22,9,21,8, 20,7,19,6,18,5, 17,4,16,3,15,2, 14,1,13,0,12,10, 11,9,10,8,9,7, 8,6,7,5,6,4};
+const uint8_t AMBE_Y[36] = {0,2,0,2,0,2, 0,2,0,3,0,3, 1,3,1,3,1,3, 1,3,1,3,1,3, 1,3,1,3,1,3, 1,3,1,3,1,3};
+const uint8_t AMBE_Z[36] = {5,3,4,2,3,1, 2,0,1,13,0,12, 22,11,21,10,20,9, 19,8,18,7,17,6, 16,5,15,4,14,3, 13,2,12,1,11,0};
+
+const uint8_t		AMBE_SILENCE[9] = {0xB9U, 0xE8U, 0x81U, 0x52U, 0x61U, 0x73U, 0x00U, 0x2AU, 0x6BU};
+const uint8_t		pcm_silence[320];
+uint32_t			golay23_patterns[2048]; //error pattern of each syndrome, its weight in bits 24-25
+
+uint32_t golay23_syndrome(uint32_t w)
+{
+	for (int i = 22; i >= 11; i--) {
+		if ((w >> i) & 1U)
+			w ^= 0xC75U << (i - 11); //x^11+x^10+x^6+x^5+x^4+x^2+1
+	}
+	return w;
+}
+
+//the code is perfect, every syndrome belongs to exactly one pattern of up to 3 errors
+void golay23_init()
+{
+	for (uint32_t a = 0U; a < 23U; a++) {
+		for (uint32_t b = a; b < 23U; b++) {
+			for (uint32_t c = b; c < 23U; c++) {
+				uint32_t p = (1U << a) | (1U << b) | (1U << c);
+				uint32_t weight = 1U + (b != a) + ((c != b) && (c != a));
+				golay23_patterns[golay23_syndrome(p)] = p | (weight << 24);
+			}
+		}
+	}
+	golay23_patterns[0] = 0U;
+}
+
+//corrects the 23 bit word, returns the number of bits corrected
+int golay23_correct(uint32_t *w)
+{
+	uint32_t p = golay23_patterns[golay23_syndrome(*w)];
+	*w ^= p & 0x7FFFFFU;
+	return p >> 24;
+}
+
+//unpacks the four vectors of a frame, C0 and C1 error corrected, C0 without its parity bit.
+//returns the bits corrected by Golay(24,12) on C0 and Golay(23,12) on C1, the latter scrambled with a sequence seeded from the C0 data
+int ambe_vectors(const uint8_t *frame, uint32_t *c)
+{
+	c[0] = c[1] = c[2] = c[3] = 0U;
+	for (unsigned int i = 0U; i < 36U; i++) {
+		uint8_t dibit = (frame[i / 4U] >> (6U - 2U * (i % 4U))) & 3U;
+		c[AMBE_W[i]] |= (uint32_t)(dibit >> 1) << AMBE_X[i];
+		c[AMBE_Y[i]] |= (uint32_t)(dibit & 1U) << AMBE_Z[i];
+	}
+	
+	c[0] >>= 1; //bit 0 is the extended parity
+	int errs = golay23_correct(&c[0]);
+	
+	uint32_t pr = 16U * (c[0] >> 11);
+	for (int j = 22; j >= 0; j--) {
+		pr = (173U * pr + 13849U) & 0xFFFFU;
+		c[1] ^= (pr >> 15) << j;
+	}
+	return errs + golay23_correct(&c[1]);
+}
+
+int ambe_errors(const uint8_t *frame)
+{
+	uint32_t c[4];
+	return ambe_vectors(frame, c);
+}
+
+//pitch index of the corrected vectors, 120 and up are not voiced
+static inline int ambe_b0(const uint32_t *c)
+{
+	return ((c[0] >> 19) << 3) | ((c[3] >> 9) & 7U);
+}
+
+#define AMBE_VOICE 0
+#define AMBE_BAD 1 //beyond repair
+#define AMBE_QUIET 2 //silence, or a level under AMBE_QUIET_GAMMA
+
+//gain step of each b2 index in 1/16 of log2 amplitude, the decoder gain is gamma = step + gamma / 2
+const int8_t AMBE_DG[32] = {-32, -11, 5, 11, 17, 23, 30, 36, 40, 43, 45, 46, 48, 50, 52, 53,
+							55, 57, 59, 61, 63, 64, 66, 68, 70, 73, 75, 78, 81, 84, 87, 90};
+
+//what a frame is worth to the vocoder. gamma is the decoder gain of the stream, followed the way the decoder does,
+//errs gets the bits corrected. b0 (pitch, or 124-125 for silence) is info bits 0-3 and 37-39, b2 (gain) bits 8-11 and 36
+int ambe_classify(const uint8_t *frame, int *gamma, int *errs)
+{
+	uint32_t c[4];
+	*errs = ambe_vectors(frame, c);
+	if (*errs > AMBE_MAX_ERRORS)
+		return AMBE_BAD; //the decoder repeats the last frame, its gain does not move
+	uint32_t d0 = c[0] >> 11;
+	int b0 = ambe_b0(c);
+	int b2 = ((d0 & 15U) << 1) | ((c[3] >> 12) & 1U);
+	*gamma = AMBE_DG[b2] + *gamma / 2;
+	if ( (b0 == 124) || (b0 == 125) || (*gamma < AMBE_QUIET_GAMMA) )
+		return AMBE_QUIET;
+	return AMBE_VOICE;
+}
+
+int dmrids_compare(const void *a, const void *b)
+{
+	const dmrids_entry *ea = a;
+	const dmrids_entry *eb = b;
+	if (ea->id != eb->id)
+		return (ea->id < eb->id) ? -1 : 1;
+	//same id on several lines, keep file order so the first one wins
+	return (ea->callsign < eb->callsign) ? -1 : (ea->callsign > eb->callsign);
+}
+
+void dmrids_free(dmrids_index *idx)
+{
+	if (idx == NULL)
+		return;
+	free(idx->entries);
+	free(idx->pool);
+	free(idx);
+}
+
+dmrids_index *dmrids_load(const char *path)
+{
+	struct stat st;
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return NULL;
+	if ( (fstat(fileno(f), &st) == -1) || (st.st_size <= 0) ) {
+		fclose(f);
+		return NULL;
+	}
+	
+	//read the whole file at once, callsigns are stored in place in the same buffer
+	dmrids_index *idx = calloc(1, sizeof(dmrids_index));
+	char *data = malloc(st.st_size + 1);
+	if ( (idx == NULL) || (data == NULL) || (fread(data, 1, st.st_size, f) != (size_t)st.st_size) ) {
+		fclose(f);
+		free(data);
+		free(idx);
+		return NULL;
+	}
+	fclose(f);
+	data[st.st_size] = '\0';
+	idx->pool = data;
+	idx->mtime = st.st_mtime;
+	idx->ino = st.st_ino;
+	idx->size = st.st_size;
+	
+	int alloc = 0;
+	bool sorted = true;
+	char *p = data;
+	char *end = data + st.st_size;
+	while (p < end) {
+		char *eol = memchr(p, '\n', end - p);
+		if (eol == NULL)
+			eol = end;
+		*eol = '\0';
+		
+		char *q;
+		unsigned long id = strtoul(p, &q, 10);
+		if (q != p) {
+			while ((*q == ' ') || (*q == '\t'))
+				q++;
+			char *cs = q;
+			while ((*q != '\0') && !isspace((unsigned char)*q) && (q - cs < 19))
+				q++;
+			*q = '\0';
+			
+			if (idx->count == alloc) {
+				alloc = alloc ? alloc * 2 : 65536;
+				dmrids_entry *e = realloc(idx->entries, alloc * sizeof(dmrids_entry));
+				if (e == NULL) {
+					dmrids_free(idx);
+					return NULL;
+				}
+				idx->entries = e;
+			}
+			if ( (idx->count > 0) && (idx->entries[idx->count-1].id > id) )
+				sorted = false;
+			idx->entries[idx->count].id = id;
+			idx->entries[idx->count].callsign = cs - data;
+			idx->count++;
+		}
+		p = eol + 1;
+	}
+	
+	if (!sorted)
+		qsort(idx->entries, idx->count, sizeof(dmrids_entry), dmrids_compare);
+	
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	dmrids_loadms = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000;
+	return idx;
+}
+
+const char *dmrids_lookup(uint32_t id)
+{
+	dmrids_lookups++;
+	if (dmrids == NULL)
+		return NULL;
+	
+	//lower bound, so duplicated ids resolve to the first line in the file
+	int lo = 0, hi = dmrids->count;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (dmrids->entries[mid].id < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if ( (lo < dmrids->count) && (dmrids->entries[lo].id == id) ) {
+		dmrids_hits++;
+		return dmrids->pool + dmrids->entries[lo].callsign;
+	}
+	return NULL;
+}
+
+void *dmrids_loader(void *arg)
+{
+	dmrids_index *idx = dmrids_load(DMRIDS_FILE);
+	pthread_mutex_lock(&dmrids_mutex);
+	dmrids_pending = idx;
+	dmrids_loading = false;
+	pthread_mutex_unlock(&dmrids_mutex);
+	return NULL;
+}
+
+void dmrids_check()
+{
+	//swap in an index finished by the loader thread
+	pthread_mutex_lock(&dmrids_mutex);
+	dmrids_index *idx = dmrids_pending;
+	dmrids_pending = NULL;
+	bool loading = dmrids_loading;
+	pthread_mutex_unlock(&dmrids_mutex);
+	if (idx != NULL) {
+		dmrids_free(dmrids);
+		dmrids = idx;
+		printf("DMRIds: loaded %d ids in %d ms (lookups: %llu, hits: %llu)\n", dmrids->count, dmrids_loadms,
+				(unsigned long long)dmrids_lookups, (unsigned long long)dmrids_hits);
+	}
+	if (loading)
+		return;
+	
+	//reload in background when the file gets replaced
+	struct stat st;
+	if (stat(DMRIDS_FILE, &st) == -1)
+		return;
+	if ( (dmrids != NULL) && (dmrids->mtime == st.st_mtime) && (dmrids->ino == st.st_ino) && (dmrids->size == st.st_size) )
+		return;
+	
+	pthread_t th;
+	pthread_mutex_lock(&dmrids_mutex);
+	dmrids_loading = (pthread_create(&th, NULL, dmrids_loader, NULL) == 0);
+	pthread_mutex_unlock(&dmrids_mutex);
+	if (!dmrids_loading) {
+		fprintf(stderr, "failed to start DMRIds loader thread\n");
+		return;
+	}
+	pthread_detach(th);
+}
+
+int process_connect(master *m, int connect_status, uint8_t *rxbuf)
 {
 	char in[100];
 	char out[400];
@@ -875,16 +1488,16 @@ int process_connect(int connect_status, char *buf)
 	switch(connect_status){
 	case CONNECTING:
 		connect_status = DMR_AUTH;
-		memcpy(in, &buf[6], 4);
+		memcpy(in, &rxbuf[6], 4);
 		memcpy(out, "RPTK", 4);
 		out[4] = (dmrid >> 24) & 0xff;
 		out[5] = (dmrid >> 16) & 0xff;
 		out[6] = (dmrid >> 8) & 0xff;
 		out[7] = (dmrid >> 0) & 0xff;
-		memcpy(&in[4], host1_pw, strlen(host1_pw));
-		sha256_generate(in, strlen(host1_pw) + sizeof(uint32_t), &out[8]);
+		memcpy(&in[4], m->pw, strlen(m->pw));
+		sha256_generate(in, strlen(m->pw) + sizeof(uint32_t), &out[8]);
 		len = 40;
-		fprintf(stderr, "Sending auth to DMR...\n");
+		fprintf(stderr, "Sending auth to %s:%d...\n", m->url, m->port);
 		break;
 	case DMR_AUTH:
 		connect_status = DMR_CONF;
@@ -898,36 +1511,27 @@ int process_connect(int connect_status, char *buf)
 		sprintf(&out[8], "%-8.8s%09u%09u%02u%02u%8.8s%9.9s%03d%-20.20s%-19.19s%c%-124.124s%-40.40s%-40.40s", callsign,
 				435000000, 435000000, 1, 1, latitude, longitude, 0, "Nowhere","Portugal", '4', "www.google.com", "20210101", "MMDVM"); // 302 bytes
 		len = 302;
-		fprintf(stderr, "Sending conf to DMR...\n");
+		fprintf(stderr, "Sending conf to %s:%d...\n", m->url, m->port);
 		break;
 	case DMR_CONF:
 		connect_status = CONNECTED_RW;
-		memcpy(buf, "DMRD", 4);
-		buf[4] = 0x00;
-		buf[5] = (((dmrid>99999999)?dmrid/100:dmrid) >> 16) & 0xff;
-		buf[6] = (((dmrid>99999999)?dmrid/100:dmrid) >> 8) & 0xff;
-		buf[7] = (((dmrid>99999999)?dmrid/100:dmrid) >> 0) & 0xff;
-		buf[8] = (host1_tg >> 16) & 0xff;
-		buf[9] = (host1_tg >> 8) & 0xff;
-		buf[10] = (host1_tg >> 0) & 0xff;
-		buf[11] = (dmrid >> 24) & 0xff;
-		buf[12] = (dmrid >> 16) & 0xff;
-		buf[13] = (dmrid >> 8) & 0xff;
-		buf[14] = (dmrid >> 0) & 0xff;
-		buf[15] = 0xa1;
-		buf[16] = 0xb6;
-		buf[17] = 0x01;
-		buf[18] = 0x00;
-		buf[19] = 0x00;
-		generate_header();
-		memcpy(out, buf, 55);
-		len = 55;
-		fprintf(stderr, "Connected to DMR\n");
-		if (host1_tg == 0)
+		{
+			//group call header on slot 2 to key up the tg
+			dmrd_builder b;
+			static const uint8_t keyup_streamid[4] = {0xb6, 0x01, 0x00, 0x00};
+			uint32_t streamid;
+			memcpy(&streamid, keyup_streamid, 4);
+			dmrd_builder_init(&b, dmr_srcid(), m->tg, dmrid, 1, 0, streamid);
+			dmrd_build(&b, (uint8_t *)out, 0, DMRMMDVM_FRAMETYPE_DATASYNC, MMDVM_SLOTTYPE_HEADER);
+			generate_header((uint8_t *)out);
+		}
+		len = DMRD_LEN;
+		fprintf(stderr, "Connected to %s:%d\n", m->url, m->port);
+		if (m->tg == 0)
 			return connect_status; //do not send header to key the tg
 		break;
 	}
-	sendto(udp1, out, len, 0, (const struct sockaddr *)&host1, sizeof(host1));
+	sendto(m->sock, out, len, 0, (const struct sockaddr *)&m->addr, sizeof(m->addr));
 #ifdef DEBUG
 	fprintf(stderr, "SEND DMR: ");
 	for(int i = 0; i < len; ++i)
@@ -956,39 +1560,2799 @@ typedef struct wav_header_t {
   int data_bytes; // Number of bytes in data. Number of samples * num_channels * sample byte size
 } wav_header;
 
-int main(int argc, char **argv)
+#define MAX_RECORDINGS (2 * MAX_RX_SESSIONS + MAX_VOCODERS) //ambe and wav of every rx session, plus a backfill wav per channel
+#define RECORDER_QUEUE_SIZE 4096 //blocks, about 80s of audio for one stream
+#define RECORDER_BLOCK_SIZE 320
+#define RECORDER_BUFSIZE 16000 //per recording write buffer, 0.5s of audio
+#define RECORDER_PREALLOC 480000 //disk space reserved ahead of the data, 30s of audio
+
+#define REC_WAV 0
+#define REC_RAW 1
+
+#define WAV_PCM 1 //wav format tags
+#define WAV_ULAW 7
+#define WAV_IMA_ADPCM 0x11
+#define ADPCM_BLOCK 256 //bytes per ima adpcm block
+#define ADPCM_BLOCK_SAMPLES ((ADPCM_BLOCK - 4) * 2 + 1) //the first sample of a block is stored whole in its header
+
+#define RECORDER_OPEN 0
+#define RECORDER_DATA 1
+#define RECORDER_CLOSE 2
+
+typedef struct recorder_cmd_t {
+	uint8_t type;
+	uint8_t rec;
+	uint16_t len;
+	uint8_t data[RECORDER_BLOCK_SIZE];
+} recorder_cmd;
+
+typedef struct recording_t {
+	bool used; //owned by the main loop from open until the writer thread has closed the file, atomic
+	int type;
+	char path[4096+100];
+	int fd;
+	off_t size; //bytes written, including header
+	off_t prealloc;
+	int hdrlen;
+	uint32_t samples;
+	int pred; //ima adpcm encoder state
+	int index;
+	int blockn; //samples in the pending block
+	uint8_t block[ADPCM_BLOCK];
+	int buflen;
+	uint8_t buf[RECORDER_BUFSIZE];
+} recording;
+
+recording			recordings[MAX_RECORDINGS];
+uint64_t			recorder_writes = 0; //written by the writer thread
+uint64_t			recorder_writeus = 0;
+uint32_t			recorder_maxwriteus = 0;
+histogram			recorder_writehist;
+
+static inline void store16le(uint8_t *p, uint16_t v)
 {
-	struct 	sockaddr_in rx;
-	struct 	hostent *hp;
-	struct 	timeval tv;
-	char *	host1_url;
-	char *	host2_url;
-	int 	host1_port;
-	int 	host2_port;
-	int 	rxlen;
-	int 	r;
-	int 	udprx,maxudp;
-	socklen_t l = sizeof(host1);
-	time_t pong_time1;
-	int64_t rx_streamid = -1;
-	uint32_t tx_streamid = 0;
-	time_t rx_endt = 0;
-	FILE *rx_ambefile = NULL;
-	FILE *rx_wavefile = NULL;
-	FILE *tx_wavefile = NULL;
-	wav_header rx_wavheader;
-	int rx_ambefcnt = 0;
-	int tx_ambefcnt = 0;
-	uint8_t tx_ambefr[3][9];
-	int64_t trgus = 0;
-	int rx_srcid = 0;
-	uint8_t rx_calltype = 0;
-	bool txpending = false;
-	
-	//change stdout/stderr to line buffering
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static inline void store32le(uint8_t *p, uint32_t v)
+{
+	store16le(p, v);
+	store16le(p + 2, v >> 16);
+}
+
+//riff header of a recording with the sizes known so far, returns its length
+int wav_header_build(uint8_t *h, int format, uint32_t samples, uint32_t data_bytes)
+{
+	uint8_t *p = h;
+	memcpy(p, "RIFF", 4);
+	memcpy(p + 8, "WAVE", 4);
+	memcpy(p + 12, "fmt ", 4);
+	store32le(p + 16, (format == WAV_PCM) ? 16 : (format == WAV_ULAW) ? 18 : 20);
+	p += 20;
+	store16le(p, format);
+	store16le(p + 2, 1); //mono
+	store32le(p + 4, 8000);
+	switch (format) {
+	case WAV_PCM:
+		store32le(p + 8, 16000);
+		store16le(p + 12, 2);
+		store16le(p + 14, 16);
+		p += 16;
+		break;
+	case WAV_ULAW:
+		store32le(p + 8, 8000);
+		store16le(p + 12, 1);
+		store16le(p + 14, 8);
+		store16le(p + 16, 0); //no extra format bytes
+		p += 18;
+		break;
+	case WAV_IMA_ADPCM:
+		store32le(p + 8, 8000 * ADPCM_BLOCK / ADPCM_BLOCK_SAMPLES);
+		store16le(p + 12, ADPCM_BLOCK);
+		store16le(p + 14, 4);
+		store16le(p + 16, 2);
+		store16le(p + 18, ADPCM_BLOCK_SAMPLES);
+		p += 20;
+		break;
+	}
+	if (format != WAV_PCM) { //compressed formats carry the sample count
+		memcpy(p, "fact", 4);
+		store32le(p + 4, 4);
+		store32le(p + 8, samples);
+		p += 12;
+	}
+	memcpy(p, "data", 4);
+	store32le(p + 4, data_bytes);
+	p += 8;
+	store32le(h + 4, (p - h) - 8 + data_bytes);
+	return p - h;
+}
+
+//G.711 mu-law of every 14 bit sample, the low 2 bits of a 16 bit sample are dropped anyway
+uint8_t ulaw_table[16384];
+
+void ulaw_init()
+{
+	for (int i = 0; i < 16384; i++) {
+		int v = (int16_t)(i << 2) >> 2; //sign extend
+		uint8_t mask = 0xFF;
+		if (v < 0) {
+			v = -v;
+			mask = 0x7F;
+		}
+		if (v > 8159)
+			v = 8159;
+		v += 0x84 >> 2;
+		int seg = 0;
+		while ( (seg < 8) && (v > ((0x40 << seg) - 1)) ) //segment ends 0x3F, 0x7F, 0xFF ... 0x1FFF
+			seg++;
+		if (seg >= 8)
+			ulaw_table[i] = 0x7F ^ mask;
+		else
+			ulaw_table[i] = ((seg << 4) | ((v >> (seg + 1)) & 0xF)) ^ mask;
+	}
+}
+
+static const int8_t IMA_INDEX[16] = {-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8};
+
+static const int16_t IMA_STEP[89] = {
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45, 50, 55, 60, 66, 73, 80, 88, 97, 107,
+	118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+	1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894,
+	6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+//one ima adpcm nibble, moves the predictor the way the decoder will
+uint8_t ima_encode(int sample, int *pred, int *index)
+{
+	int step = IMA_STEP[*index];
+	int diff = sample - *pred;
+	uint8_t nib = 0;
+	if (diff < 0) {
+		nib = 8;
+		diff = -diff;
+	}
+	int vpdiff = step >> 3;
+	if (diff >= step) {
+		nib |= 4;
+		diff -= step;
+		vpdiff += step;
+	}
+	step >>= 1;
+	if (diff >= step) {
+		nib |= 2;
+		diff -= step;
+		vpdiff += step;
+	}
+	step >>= 1;
+	if (diff >= step) {
+		nib |= 1;
+		vpdiff += step;
+	}
+	*pred += (nib & 8) ? -vpdiff : vpdiff;
+	if (*pred > 32767)
+		*pred = 32767;
+	else if (*pred < -32768)
+		*pred = -32768;
+	*index += IMA_INDEX[nib];
+	if (*index < 0)
+		*index = 0;
+	else if (*index > 88)
+		*index = 88;
+	return nib;
+}
+
+int					pcm_gain = 256; //--gain and --agc, taken by every recording when it starts
+bool				pcm_agc = false;
+
+void pcm_level_init(pcm_level *l)
+{
+	l->gain = pcm_gain;
+	l->agc = pcm_agc;
+	l->agcgain = 256;
+}
+
+//swap byte order of n samples, n a multiple of 8
+void pcm_swap(uint8_t *out, const uint8_t *in, int n)
+{
+	int i = 0;
+#if defined(__SSE2__)
+	for (; i < n; i += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i *)&in[i * 2]);
+		_mm_storeu_si128((__m128i *)&out[i * 2], _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8)));
+	}
+#elif defined(__ARM_NEON)
+	for (; i < n; i += 8)
+		vst1q_u8(&out[i * 2], vrev16q_u8(vld1q_u8(&in[i * 2])));
+#endif
+	for (; i < n; i++) {
+		uint8_t b = in[i * 2];
+		out[i * 2] = in[i * 2 + 1];
+		out[i * 2 + 1] = b;
+	}
+}
+
+//msb first samples from the vocoder to host order, scaled by gain/256 and clipped, in one pass.
+//in and out may be the same buffer, n a multiple of 8. returns the input peak
+int pcm_convert(uint8_t *out, const uint8_t *in, int n, int gain)
+{
+	int i = 0;
+	int peak = 0;
+#if defined(__SSE2__)
+	__m128i g = _mm_set1_epi16(gain);
+	__m128i vpeak = _mm_setzero_si128();
+	for (; i < n; i += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i *)&in[i * 2]);
+		x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+		vpeak = _mm_max_epi16(vpeak, _mm_max_epi16(x, _mm_subs_epi16(_mm_setzero_si128(), x)));
+		__m128i lo = _mm_mullo_epi16(x, g);
+		__m128i hi = _mm_mulhi_epi16(x, g);
+		__m128i a = _mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), 8);
+		__m128i b = _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), 8);
+		_mm_storeu_si128((__m128i *)&out[i * 2], _mm_packs_epi32(a, b));
+	}
+	int16_t lanes[8];
+	_mm_storeu_si128((__m128i *)lanes, vpeak);
+	for (int k = 0; k < 8; k++)
+		if (lanes[k] > peak)
+			peak = lanes[k];
+#elif defined(__ARM_NEON)
+	int16x4_t g = vdup_n_s16(gain);
+	int16x8_t vpeak = vdupq_n_s16(0);
+	for (; i < n; i += 8) {
+		int16x8_t x = vreinterpretq_s16_u8(vrev16q_u8(vld1q_u8(&in[i * 2])));
+		vpeak = vmaxq_s16(vpeak, vqabsq_s16(x));
+		int16x4_t a = vqshrn_n_s32(vmull_s16(vget_low_s16(x), g), 8);
+		int16x4_t b = vqshrn_n_s32(vmull_s16(vget_high_s16(x), g), 8);
+		vst1q_u8(&out[i * 2], vreinterpretq_u8_s16(vcombine_s16(a, b)));
+	}
+	int16_t lanes[8];
+	vst1q_s16(lanes, vpeak);
+	for (int k = 0; k < 8; k++)
+		if (lanes[k] > peak)
+			peak = lanes[k];
+#endif
+	for (; i < n; i++) {
+		int v = (int16_t)((in[i * 2] << 8) | in[i * 2 + 1]);
+		if (abs(v) > peak)
+			peak = (abs(v) > 32767) ? 32767 : abs(v);
+		v = (v * gain) >> 8;
+		if (v > 32767)
+			v = 32767;
+		else if (v < -32768)
+			v = -32768;
+		int16_t o = v;
+		memcpy(&out[i * 2], &o, 2);
+	}
+	return peak;
+}
+
+//one decoded frame in place. the agc gain follows the peak of each frame and is used from the next one on,
+//so the conversion stays a single pass: it drops at once when the level would clip, and recovers over about 16 frames
+void pcm_level_apply(pcm_level *l, uint8_t *pcm, int n)
+{
+	int gain = l->gain;
+	if (l->agc) {
+		gain = (gain * l->agcgain) >> 8;
+		if (gain > 32767)
+			gain = 32767;
+	}
+	int peak = pcm_convert(pcm, pcm, n, gain);
+	if ( !l->agc || (peak < AGC_FLOOR) )
+		return;
+	int want = (AGC_TARGET * 256) / peak;
+	if (want > AGC_MAXGAIN)
+		want = AGC_MAXGAIN;
+	if (want < l->agcgain)
+		l->agcgain = want;
+	else
+		l->agcgain += (want - l->agcgain) / 16;
+}
+
+//--gain DB and --agc at argv[i], returns the arguments used, 0 when it is not one of them, -1 when invalid
+int pcm_option(int argc, char **argv, int i)
+{
+	if (strcmp(argv[i], "--agc") == 0) {
+		pcm_agc = true;
+		return 1;
+	}
+	if ( (strcmp(argv[i], "--gain") != 0) || (i + 1 >= argc) )
+		return 0;
+	int db = atoi(argv[i + 1]);
+	if ( (db < -24) || (db > 24) ) {
+		fprintf(stderr, "gain must be -24 to 24 dB\n");
+		return -1;
+	}
+	double g = 256.0;
+	for (int k = 0; k < abs(db); k++) //in whole dB steps, keeps libm out
+		g = (db > 0) ? g * 1.122018454 : g / 1.122018454;
+	pcm_gain = (int)(g + 0.5);
+	return 2;
+}
+
+void recorder_flush(recording *r)
+{
+	if ( (r->buflen == 0) || (r->fd == -1) ) {
+		r->buflen = 0;
+		return;
+	}
+	
+	//keep disk space reserved ahead of the data, so appends do not wait for block allocation
+	if (r->size + r->buflen > r->prealloc) {
+		r->prealloc += RECORDER_PREALLOC;
+		fallocate(r->fd, FALLOC_FL_KEEP_SIZE, 0, r->prealloc); //best effort, not every filesystem supports it
+	}
+	
+	int64_t t0 = now_us();
+	ssize_t n = write(r->fd, r->buf, r->buflen);
+	uint32_t us = now_us() - t0;
+	if (n != r->buflen)
+		fprintf(stderr, "failed to write %s\n", r->path);
+	else
+		r->size += n;
+	r->buflen = 0;
+	
+	__atomic_store_n(&recorder_writes, recorder_writes + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&recorder_writeus, recorder_writeus + us, __ATOMIC_RELAXED);
+	if (us > recorder_maxwriteus)
+		__atomic_store_n(&recorder_maxwriteus, us, __ATOMIC_RELAXED);
+	histogram_add(&recorder_writehist, us);
+}
+
+//append a block of 16 bit samples in the recording format, the buffer has room for it
+void recorder_encode(recording *r, const int16_t *pcm, int n)
+{
+	uint8_t *out = r->buf + r->buflen;
+	r->samples += n;
+	switch (WAV_FORMAT) {
+	case WAV_PCM:
+		memcpy(out, pcm, n * 2);
+		r->buflen += n * 2;
+		break;
+	case WAV_ULAW:
+		for (int i = 0; i < n; i++)
+			out[i] = ulaw_table[(uint16_t)pcm[i] >> 2];
+		r->buflen += n;
+		break;
+	case WAV_IMA_ADPCM:
+		for (int i = 0; i < n; i++) {
+			if (r->blockn == 0) {
+				//block header, the step index carries over from the previous block
+				r->pred = pcm[i];
+				store16le(r->block, pcm[i]);
+				r->block[2] = r->index;
+				r->block[3] = 0;
+			} else {
+				int k = r->blockn - 1; //low nibble first
+				uint8_t nib = ima_encode(pcm[i], &r->pred, &r->index);
+				if (k & 1)
+					r->block[4 + k / 2] |= nib << 4;
+				else
+					r->block[4 + k / 2] = nib;
+			}
+			if (++r->blockn == ADPCM_BLOCK_SAMPLES) {
+				memcpy(r->buf + r->buflen, r->block, ADPCM_BLOCK);
+				r->buflen += ADPCM_BLOCK;
+				r->blockn = 0;
+			}
+		}
+		break;
+	}
+}
+
+//pad the last adpcm block with silence, players expect whole blocks. the fact chunk keeps the real length
+void recorder_finish(recording *r)
+{
+	if ( (WAV_FORMAT != WAV_IMA_ADPCM) || (r->blockn == 0) )
+		return;
+	uint32_t samples = r->samples;
+	static const int16_t zero[ADPCM_BLOCK_SAMPLES];
+	if (r->buflen + ADPCM_BLOCK > RECORDER_BUFSIZE)
+		recorder_flush(r);
+	recorder_encode(r, zero, ADPCM_BLOCK_SAMPLES - r->blockn);
+	r->samples = samples;
+}
+
+void *recorder_thread(void *arg)
+{
+	stage_pin("recorder", CPU_RECORDER);
+	while (1) {
+		recorder_cmd *cmd = spsc_peek(&recorder_ring);
+		if (cmd == NULL) {
+			spsc_wait(&recorder_ring);
+			continue;
+		}
+		
+		//the entry stays queued while we work on it, so the main loop cannot reuse it
+		recording *r = &recordings[cmd->rec];
+		switch (cmd->type) {
+		case RECORDER_OPEN:
+			r->size = 0;
+			r->prealloc = 0;
+			r->buflen = 0;
+			r->fd = open(r->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (r->fd == -1) {
+				fprintf(stderr, "failed to open %s\n", r->path);
+				break;
+			}
+			if (r->type == REC_WAV) {
+				r->samples = 0;
+				r->index = 0;
+				r->blockn = 0;
+				r->hdrlen = wav_header_build(r->buf, WAV_FORMAT, 0, 0); //sizes filled on close
+				r->buflen = r->hdrlen;
+			}
+			break;
+		case RECORDER_DATA:
+			//encoded data is never larger than the pcm, an adpcm block at most
+			if (r->buflen + ((cmd->len > ADPCM_BLOCK) ? cmd->len : ADPCM_BLOCK) > RECORDER_BUFSIZE)
+				recorder_flush(r);
+			if (r->type == REC_WAV) {
+				int16_t pcm[RECORDER_BLOCK_SIZE / 2];
+				memcpy(pcm, cmd->data, cmd->len);
+				recorder_encode(r, pcm, cmd->len / 2);
+			} else {
+				memcpy(r->buf + r->buflen, cmd->data, cmd->len);
+				r->buflen += cmd->len;
+			}
+			break;
+		case RECORDER_CLOSE:
+			if (r->type == REC_WAV)
+				recorder_finish(r);
+			recorder_flush(r);
+			if (r->fd != -1) {
+				if (r->type == REC_WAV) {
+					uint8_t h[64];
+					int len = wav_header_build(h, WAV_FORMAT, r->samples, r->size - r->hdrlen);
+					if (pwrite(r->fd, h, len, 0) != len)
+						fprintf(stderr, "failed to write %s\n", r->path);
+				}
+				if (ftruncate(r->fd, r->size) == -1) //give back the preallocated space we did not use
+					fprintf(stderr, "failed to truncate %s\n", r->path);
+				close(r->fd);
+				r->fd = -1;
+			}
+			break;
+		}
+		
+		if (cmd->type == RECORDER_CLOSE)
+			__atomic_store_n(&r->used, false, __ATOMIC_RELEASE);
+		spsc_pop(&recorder_ring);
+	}
+	return NULL;
+}
+
+//main loop only, the writer thread is woken by recorder_kick() once per wakeup
+bool recorder_push(int type, int rec, const uint8_t *data, int len)
+{
+	//data blocks may not use the last entries, so open and close always fit
+	recorder_cmd *cmd = spsc_slot(&recorder_ring, (type == RECORDER_DATA) ? 2 * MAX_RECORDINGS : 0);
+	if (cmd == NULL)
+		return false;
+	cmd->type = type;
+	cmd->rec = rec;
+	cmd->len = len;
+	if (len > 0)
+		memcpy(cmd->data, data, len);
+	spsc_push(&recorder_ring);
+	return true;
+}
+
+void recorder_kick()
+{
+	spsc_kick(&recorder_ring);
+}
+
+int recorder_open(const char *path, int type)
+{
+	int rec = -1;
+	for (int i = 0; i < MAX_RECORDINGS; i++) {
+		if (!__atomic_load_n(&recordings[i].used, __ATOMIC_ACQUIRE)) {
+			recordings[i].used = true;
+			rec = i;
+			break;
+		}
+	}
+	if (rec == -1)
+		return -1;
+	
+	recordings[rec].type = type;
+	snprintf(recordings[rec].path, sizeof(recordings[rec].path), "%s", path);
+	if (!recorder_push(RECORDER_OPEN, rec, NULL, 0)) {
+		recordings[rec].used = false;
+		return -1;
+	}
+	return rec;
+}
+
+void recorder_write(int rec, const uint8_t *data, int len)
+{
+	if (rec >= 0)
+		recorder_push(RECORDER_DATA, rec, data, len);
+}
+
+void recorder_close(int rec)
+{
+	if (rec >= 0)
+		recorder_push(RECORDER_CLOSE, rec, NULL, 0);
+}
+
+//true until the writer thread has closed the file
+bool recorder_busy(const char *path)
+{
+	for (int i = 0; i < MAX_RECORDINGS; i++) {
+		if (__atomic_load_n(&recordings[i].used, __ATOMIC_ACQUIRE) && (strcmp(recordings[i].path, path) == 0))
+			return true;
+	}
+	return false;
+}
+
+void recorder_drain()
+{
+	recorder_kick();
+	while (spsc_depth(&recorder_ring) > 0)
+		usleep(1000);
+}
+
+//depth now, high-water mark and drops of every queue between the stages, for sizing them
+void pipeline_stats()
+{
+	spsc_ring *rings[] = { &net_ring, &tx_ring, &recorder_ring };
+	char line[256];
+	int len = 0;
+	for (unsigned int i = 0; i < sizeof(rings) / sizeof(rings[0]); i++) {
+		if (rings[i]->size == 0) //stage not running
+			continue;
+		len += snprintf(line + len, sizeof(line) - len, "%s %s %u/%u (max %u, drops %u)", (len == 0) ? "Queues:" : ",", rings[i]->name, spsc_depth(rings[i]),
+				rings[i]->size, __atomic_load_n(&rings[i]->maxdepth, __ATOMIC_RELAXED), __atomic_load_n(&rings[i]->drops, __ATOMIC_RELAXED));
+	}
+	printf("%s\n", line);
+	uint64_t writes = __atomic_load_n(&recorder_writes, __ATOMIC_RELAXED);
+	printf("Recorder: write latency avg %u us, max %u us\n", writes ? (unsigned int)(__atomic_load_n(&recorder_writeus, __ATOMIC_RELAXED) / writes) : 0,
+			__atomic_load_n(&recorder_maxwriteus, __ATOMIC_RELAXED));
+}
+
+bool recorder_start()
+{
+	for (int i = 0; i < MAX_RECORDINGS; i++)
+		recordings[i].fd = -1;
+	if (!spsc_init(&recorder_ring, "recorder", RECORDER_QUEUE_SIZE, sizeof(recorder_cmd)))
+		return false;
+	pthread_t th;
+	if (pthread_create(&th, NULL, recorder_thread, NULL) != 0)
+		return false;
+	pthread_detach(th);
+	return true;
+}
+
+void metrics_histogram(FILE *f, const char *name, const char *labels, histogram *h)
+{
+	const char *sep = (labels[0] != '\0') ? "," : "";
+	uint64_t total = 0;
+	for (int i = 0; i <= METRICS_BUCKETS; i++) {
+		total += __atomic_load_n(&h->count[i], __ATOMIC_RELAXED);
+		if (i < METRICS_BUCKETS)
+			fprintf(f, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, sep, METRICS_BOUNDS[i] / 1e6, (unsigned long long)total);
+	}
+	fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep, (unsigned long long)total);
+	fprintf(f, "%s_sum%s%s%s %g\n", name, sep[0] ? "{" : "", labels, sep[0] ? "}" : "", __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / 1e6);
+	fprintf(f, "%s_count%s%s%s %llu\n", name, sep[0] ? "{" : "", labels, sep[0] ? "}" : "", (unsigned long long)total);
+}
+
+void metrics_family(FILE *f, const char *name, const char *type, const char *help)
+{
+	fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+//prometheus text format, every value read with relaxed loads while the stages keep running
+void metrics_write(FILE *f)
+{
+	char labels[128];
+	metrics_family(f, "dmrvmsg_dmrd_frames_total", "counter", "DMRD frames received from the master.");
+	for (int i = 0; i < master_count; i++)
+		fprintf(f, "dmrvmsg_dmrd_frames_total{master=\"%s:%d\"} %llu\n", masters[i].url, masters[i].port,
+				(unsigned long long)__atomic_load_n(&masters[i].dmrdframes, __ATOMIC_RELAXED));
+	metrics_family(f, "dmrvmsg_master_state", "gauge", "Login state: 0 disconnected, 1 connecting, 2 auth, 3 config, 4 options, 5 connected, 6 connected read-only.");
+	for (int i = 0; i < master_count; i++)
+		fprintf(f, "dmrvmsg_master_state{master=\"%s:%d\"} %d\n", masters[i].url, masters[i].port, __atomic_load_n(&masters[i].connect_status, __ATOMIC_RELAXED));
+	metrics_family(f, "dmrvmsg_master_state_changes_total", "counter", "Login state changes, reconnects show up here.");
+	for (int i = 0; i < master_count; i++)
+		fprintf(f, "dmrvmsg_master_state_changes_total{master=\"%s:%d\"} %llu\n", masters[i].url, masters[i].port,
+				(unsigned long long)__atomic_load_n(&masters[i].statechanges, __ATOMIC_RELAXED));
+	metrics_family(f, "dmrvmsg_ping_rtt_seconds", "histogram", "Time from ping to pong.");
+	for (int i = 0; i < master_count; i++) {
+		snprintf(labels, sizeof(labels), "master=\"%s:%d\"", masters[i].url, masters[i].port);
+		metrics_histogram(f, "dmrvmsg_ping_rtt_seconds", labels, &masters[i].pingrtt);
+	}
+	
+	metrics_family(f, "dmrvmsg_vocoder_frames_sent_total", "counter", "Frames sent to the AMBEServer, AMBE to decode and PCM to encode.");
+	for (int i = 0; i < vocoder_count; i++)
+		fprintf(f, "dmrvmsg_vocoder_frames_sent_total{vocoder=\"%s:%d\"} %llu\n", vocoders[i].url, vocoders[i].port,
+				(unsigned long long)__atomic_load_n(&vocoders[i].fifo.pushed, __ATOMIC_RELAXED));
+	metrics_family(f, "dmrvmsg_vocoder_pcm_frames_total", "counter", "Decoded PCM frames received from the AMBEServer.");
+	for (int i = 0; i < vocoder_count; i++)
+		fprintf(f, "dmrvmsg_vocoder_pcm_frames_total{vocoder=\"%s:%d\"} %llu\n", vocoders[i].url, vocoders[i].port,
+				(unsigned long long)__atomic_load_n(&vocoders[i].pcmframes, __ATOMIC_RELAXED));
+	metrics_family(f, "dmrvmsg_vocoder_ambe_frames_total", "counter", "Encoded AMBE frames received from the AMBEServer.");
+	for (int i = 0; i < vocoder_count; i++)
+		fprintf(f, "dmrvmsg_vocoder_ambe_frames_total{vocoder=\"%s:%d\"} %llu\n", vocoders[i].url, vocoders[i].port,
+				(unsigned long long)__atomic_load_n(&vocoders[i].ambeframes, __ATOMIC_RELAXED));
+	metrics_family(f, "dmrvmsg_vocoder_discarded_total", "counter", "Replies from the AMBEServer with no recording or prompt left to take them.");
+	for (int i = 0; i < vocoder_count; i++) {
+		fprintf(f, "dmrvmsg_vocoder_discarded_total{vocoder=\"%s:%d\",kind=\"pcm\"} %llu\n", vocoders[i].url, vocoders[i].port,
+				(unsigned long long)__atomic_load_n(&vocoders[i].pcmdrops, __ATOMIC_RELAXED));
+		fprintf(f, "dmrvmsg_vocoder_discarded_total{vocoder=\"%s:%d\",kind=\"ambe\"} %llu\n", vocoders[i].url, vocoders[i].port,
+				(unsigned long long)__atomic_load_n(&vocoders[i].ambedrops, __ATOMIC_RELAXED));
+	}
+	metrics_family(f, "dmrvmsg_vocoder_lost_frames_total", "counter", "Frames sent to the AMBEServer that were never answered.");
+	for (int i = 0; i < vocoder_count; i++)
+		fprintf(f, "dmrvmsg_vocoder_lost_frames_total{vocoder=\"%s:%d\"} %llu\n", vocoders[i].url, vocoders[i].port,
+				(unsigned long long)__atomic_load_n(&vocoders[i].lostframes, __ATOMIC_RELAXED));
+	metrics_family(f, "dmrvmsg_vocoder_rtt_seconds", "histogram", "Time from queueing a frame to its reply.");
+	for (int i = 0; i < vocoder_count; i++) {
+		snprintf(labels, sizeof(labels), "vocoder=\"%s:%d\"", vocoders[i].url, vocoders[i].port);
+		metrics_histogram(f, "dmrvmsg_vocoder_rtt_seconds", labels, &vocoders[i].fifo.rtt);
+	}
+	
+	metrics_family(f, "dmrvmsg_disk_write_seconds", "histogram", "Time of each recorder write.");
+	metrics_histogram(f, "dmrvmsg_disk_write_seconds", "", &recorder_writehist);
+	spsc_ring *rings[] = { &net_ring, &tx_ring, &recorder_ring };
+	metrics_family(f, "dmrvmsg_queue_drops_total", "counter", "Entries dropped because a pipeline queue was full.");
+	for (unsigned int i = 0; i < sizeof(rings) / sizeof(rings[0]); i++)
+		fprintf(f, "dmrvmsg_queue_drops_total{queue=\"%s\"} %u\n", rings[i]->name, __atomic_load_n(&rings[i]->drops, __ATOMIC_RELAXED));
+	metrics_family(f, "dmrvmsg_queue_max_depth", "gauge", "High-water mark of a pipeline queue.");
+	for (unsigned int i = 0; i < sizeof(rings) / sizeof(rings[0]); i++)
+		fprintf(f, "dmrvmsg_queue_max_depth{queue=\"%s\"} %u\n", rings[i]->name, __atomic_load_n(&rings[i]->maxdepth, __ATOMIC_RELAXED));
+}
+
+//one request per connection, served off the main loop so a slow scraper cannot hold up calls
+void *metrics_thread(void *arg)
+{
+	int lsock = *(int *)arg;
+	while (1) {
+		int c = accept(lsock, NULL, NULL);
+		if (c == -1)
+			continue;
+		struct timeval tv = {1, 0};
+		setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		
+		//read the whole request first, closing with unread data would reset the connection before the reply is read
+		char req[1024];
+		int n = 0;
+		while (n < (int)sizeof(req) - 1) {
+			ssize_t r = read(c, req + n, sizeof(req) - 1 - n);
+			if (r <= 0)
+				break;
+			n += r;
+			req[n] = '\0';
+			if (strstr(req, "\r\n\r\n") != NULL)
+				break;
+		}
+		req[n] = '\0';
+		
+		char *body = NULL;
+		size_t len = 0;
+		FILE *f = open_memstream(&body, &len);
+		const char *status = "200 OK";
+		if (f == NULL) {
+			close(c);
+			continue;
+		}
+		if ( (strncmp(req, "GET /metrics ", 13) == 0) || (strncmp(req, "GET / ", 6) == 0) )
+			metrics_write(f);
+		else
+			status = "404 Not Found";
+		fclose(f);
+		
+		char head[160];
+		int hlen = snprintf(head, sizeof(head), "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", status, len);
+		if (send(c, head, hlen, MSG_NOSIGNAL) == hlen) {
+			for (size_t sent = 0; sent < len; ) {
+				ssize_t r = send(c, body + sent, len - sent, MSG_NOSIGNAL);
+				if (r <= 0)
+					break;
+				sent += r;
+			}
+		}
+		free(body);
+		close(c);
+	}
+	return NULL;
+}
+
+//not being able to serve metrics does not stop the recorder, it is only reported
+void metrics_start()
+{
+	static int lsock = -1;
+	if (METRICS_PORT == 0)
+		return;
+	lsock = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(METRICS_PORT);
+	int on = 1;
+	pthread_t th;
+	if ( (lsock == -1) || (setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1)
+	  || (bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) == -1) || (listen(lsock, 8) == -1)
+	  || (pthread_create(&th, NULL, metrics_thread, &lsock) != 0) ) {
+		fprintf(stderr, "failed to serve metrics on port %d\n", METRICS_PORT);
+		if (lsock != -1)
+			close(lsock);
+		return;
+	}
+	pthread_detach(th);
+	printf("Metrics: http://127.0.0.1:%d/metrics\n", METRICS_PORT);
+}
+
+typedef struct rx_session_t {
+	bool active;
+	uint32_t gen; //bumped for every new recording, tags frames in flight to the vocoder
+	master *host; //slots and stream ids are per master
+	uint8_t slot;
+	uint32_t streamid;
+	int srcid;
+	int dstid;
+	uint8_t calltype;
+	char callsign[20];
+	char path[4096+100]; //recording path without extension, .ambe and .wav are written side by side
+	vocoder *voc;
+	bool degraded; //no vocoder channel, only ambe is recorded and decoded later by a backfill job
+	int ambrec; //recorder ids, -1 when not recording
+	int wavrec;
+	int rxframes; //ambe frames received
+	int ambeerrs; //bits corrected by the fec check
+	int badframes; //frames not decoded, written as silence
+	int voiceframes; //frames with speech, silence is trimmed before the first one and after the last one
+	int pending; //silence frames since the last speech frame, written once speech follows
+	int gamma; //decoder gain, see ambe_classify()
+	int ambefcnt; //frames decoded live
+	int sentframes; //frames sent to the vocoder, each one ends up decoded or lost
+	int voclost; //frames the vocoder never answered, written as silence
+	int inflight; //frames at the vocoder
+	int queued; //frames waiting for room in the window
+	int qhead;
+	uint8_t sendq[VOCODER_MAXINFLIGHT][9];
+	uint16_t sendqafter[VOCODER_MAXINFLIGHT]; //silence frames that follow each queued one
+	int fifotail; //fifo entry of the last frame sent
+	pcm_level level;
+	bool playing; //a voice packet was played, gaps before the first one are not filled
+	uint8_t nextseq; //dmrd sequence number of the next voice packet to play, headers take one too
+	uint32_t held; //packets waiting for an earlier one, bit per seq % JITTER_DEPTH
+	uint8_t jitter[JITTER_DEPTH][27];
+	int lostframes; //missing packets, played as silence frames
+	int dupframes; //duplicates and packets too late to be played
+	int64_t endt; //now_ms() deadline
+} rx_session;
+
+_Static_assert((JITTER_DEPTH >= 1) && (JITTER_DEPTH <= 32) && ((JITTER_DEPTH & (JITTER_DEPTH - 1)) == 0), "JITTER_DEPTH must be a power of two up to 32");
+
+rx_session			rx_sessions[MAX_RX_SESSIONS];
+
+int vocoder_fifo_push(vocoder_fifo *f, int session, uint32_t gen, uint32_t frame)
+{
+	if (f->count == VOCODER_FIFO_SIZE)
+		return -1;
+	if (f->count == 0)
+		f->waitt = now_ms();
+	int i = (f->head + f->count) % VOCODER_FIFO_SIZE;
+	f->session[i] = session;
+	f->gen[i] = gen;
+	f->frame[i] = frame;
+	f->after[i] = 0;
+	f->sentt[i] = now_us();
+	f->count++;
+	counter_add(&f->pushed, 1);
+	return i;
+}
+
+bool vocoder_fifo_pop(vocoder_fifo *f, int *session, uint32_t *gen, uint32_t *frame, int *after)
+{
+	if (f->count == 0)
+		return false;
+	*session = f->session[f->head];
+	*gen = f->gen[f->head];
+	*frame = f->frame[f->head];
+	*after = f->after[f->head];
+	histogram_add(&f->rtt, now_us() - f->sentt[f->head]);
+	f->head = (f->head + 1) % VOCODER_FIFO_SIZE;
+	f->count--;
+	f->waitt = now_ms();
+	return true;
+}
+
+int udp_recv_batch(int sock, udp_batch *b)
+{
+	for (int i = 0; i < UDP_BATCH; i++) {
+		b->iov[i].iov_base = b->data[i];
+		b->iov[i].iov_len = UDP_BATCH_PKTSIZE;
+		memset(&b->msgs[i].msg_hdr, 0, sizeof(b->msgs[i].msg_hdr));
+		b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+		b->msgs[i].msg_hdr.msg_iovlen = 1;
+		b->msgs[i].msg_hdr.msg_name = &b->addr[i];
+		b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addr[i]);
+	}
+	int n = recvmmsg(sock, b->msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+	b->count = (n > 0) ? n : 0;
+	return b->count;
+}
+
+void udp_flush(int sock, udp_batch *b)
+{
+	int sent = 0;
+	while (sent < b->count) {
+		int n = sendmmsg(sock, &b->msgs[sent], b->count - sent, 0);
+		if (n <= 0) {
+			if ( (n == -1) && (errno == EINTR) )
+				continue;
+			break; //socket buffer full or error, drop the rest like sendto would
+		}
+		sent += n;
+	}
+	b->count = 0;
+}
+
+void udp_queue(int sock, udp_batch *b, const struct sockaddr_in *to, const uint8_t *data, int len)
+{
+	if (b->count == UDP_BATCH)
+		udp_flush(sock, b);
+	int i = b->count++;
+	memcpy(b->data[i], data, len);
+	b->iov[i].iov_base = b->data[i];
+	b->iov[i].iov_len = len;
+	memset(&b->msgs[i].msg_hdr, 0, sizeof(b->msgs[i].msg_hdr));
+	b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+	b->msgs[i].msg_hdr.msg_iovlen = 1;
+	b->msgs[i].msg_hdr.msg_name = (void *)to;
+	b->msgs[i].msg_hdr.msg_namelen = sizeof(*to);
+}
+
+void vocoder_send(vocoder *v, const uint8_t *data, int len)
+{
+	if (v->txq.count == UDP_BATCH)
+		v->backend->flush(v);
+	udp_queue(v->sock, &v->txq, &v->addr, data, len);
+	v->lastsend = now_ms();
+}
+
+void vocoder_flush()
+{
+	for (int i = 0; i < vocoder_count; i++) {
+		if (vocoders[i].txq.count > 0)
+			vocoders[i].backend->flush(&vocoders[i]);
+	}
+}
+
+const uint8_t ambe_gain[] = {0x61,0x00,0x03,0x00,0x4B,AMBE_ENCODE_GAIN,AMBE_DECODE_GAIN};
+const uint8_t ambe_ratep[] = {0x61,0x00,0x0D,0x00,0x0A,0x04,0x31,0x07,0x54,0x24,0x00,0x00,0x00,0x00,0x00,0x6F,0x48};
+
+void vocoder_setup(vocoder *v)
+{
+	vocoder_send(v, ambe_gain, sizeof(ambe_gain));
+	vocoder_send(v, ambe_ratep, sizeof(ambe_ratep));
+}
+
+vocoder *vocoder_find(int sock)
+{
+	for (int i = 0; i < vocoder_count; i++) {
+		if (vocoders[i].sock == sock)
+			return &vocoders[i];
+	}
+	return NULL;
+}
+
+char				*backfill_queue[BACKFILL_QUEUE]; //recording paths without extension, waiting for an idle channel
+int					backfill_head = 0;
+int					backfill_count = 0;
+uint32_t			backfill_gen = 0;
+int					backfill_window = BACKFILL_WINDOW;
+int					backfill_files = 0; //decoded, failed to read
+int					backfill_failed = 0;
+uint64_t			backfill_frames = 0;
+
+void backfill_add(const char *path, bool front)
+{
+	if (backfill_count == BACKFILL_QUEUE) {
+		fprintf(stderr, "backfill queue full, %s.ambe left undecoded\n", path);
+		return;
+	}
+	if (front) {
+		backfill_head = (backfill_head + BACKFILL_QUEUE - 1) % BACKFILL_QUEUE;
+		backfill_queue[backfill_head] = strdup(path);
+	} else {
+		backfill_queue[(backfill_head + backfill_count) % BACKFILL_QUEUE] = strdup(path);
+	}
+	backfill_count++;
+}
+
+void backfill_end(backfill_job *j)
+{
+	recorder_close(j->wavrec);
+	j->wavrec = -1;
+	free(j->frames);
+	j->frames = NULL;
+	j->active = false;
+}
+
+//a live stream or tx needs the channel, give it back and start over later
+void backfill_abort(vocoder *v)
+{
+	backfill_job *j = &v->backfill;
+	printf("*** BACKFILL PAUSED (%s.wav, vocoder: %d) ***\n", j->path, (int)(v - vocoders) + 1);
+	backfill_end(j);
+	backfill_add(j->path, true);
+}
+
+bool backfill_start(vocoder *v)
+{
+	backfill_job *j = &v->backfill;
+	while (backfill_count > 0) {
+		char *path = backfill_queue[backfill_head];
+		char filename[4096+100+5];
+		sprintf(filename, "%s.ambe", path);
+		if (recorder_busy(filename)) //still being written, try again on a later wakeup
+			return false;
+		
+		//small file, about 27kB per minute of audio
+		j->frames = NULL;
+		j->nframes = 0;
+		FILE *f = fopen(filename, "rb");
+		if (f != NULL) {
+			uint8_t header[4];
+			fseek(f, 0, SEEK_END);
+			long size = ftell(f);
+			fseek(f, 0, SEEK_SET);
+			if ( (size >= (long)sizeof(header)) && (fread(header, 1, sizeof(header), f) == sizeof(header))
+			  && (memcmp(header, "AMBE", 4U) == 0) ) {
+				j->nframes = (size - sizeof(header)) / 9;
+				j->frames = malloc(j->nframes * 9 + 1);
+				if ( (j->frames == NULL) || (fread(j->frames, 9, j->nframes, f) != (size_t)j->nframes) )
+					j->nframes = 0;
+			}
+			fclose(f);
+		}
+		
+		strcpy(j->path, path);
+		backfill_head = (backfill_head + 1) % BACKFILL_QUEUE;
+		backfill_count--;
+		free(path);
+		if (j->nframes == 0) {
+			fprintf(stderr, "failed to read %s, not decoded\n", filename);
+			backfill_failed++;
+			free(j->frames);
+			j->frames = NULL;
+			continue;
+		}
+		
+		sprintf(filename, "%s.wav", j->path); //replaces the partial file of the live decoding, if any
+		j->wavrec = recorder_open(filename, REC_WAV);
+		pcm_level_init(&j->level);
+		if (j->wavrec == -1) {
+			fprintf(stderr, "failed to open wav file\n");
+			free(j->frames);
+			j->frames = NULL;
+			backfill_add(j->path, true);
+			return false;
+		}
+		j->active = true;
+		j->gen = ++backfill_gen;
+		j->sent = 0;
+		j->done = 0;
+		j->gamma = 0;
+		j->voiced = false;
+		j->pending = 0;
+		printf("*** BACKFILL START (%s.wav, ambeframes: %d, vocoder: %d) ***\n", j->path, j->nframes, (int)(v - vocoders) + 1);
+		vocoder_setup(v);
+		return true;
+	}
+	return false;
+}
+
+//decode degraded recordings on channels nobody else is using, a few frames in flight at a time
+void backfill_run()
+{
+	for (int i = 0; i < vocoder_count; i++) {
+		vocoder *v = &vocoders[i];
+		backfill_job *j = &v->backfill;
+		if ( (v->users > 0) || v->down )
+			continue;
+		if (!j->active && !backfill_start(v))
+			continue;
+		uint8_t ambebuf[4+2+9] = {0x61, 0x00, 2+9, 0x01,  0x01, 72};
+		for (; (j->sent < j->nframes) && (j->sent - j->done < backfill_window); j->sent++) {
+			const uint8_t *frame = &j->frames[j->sent * 9];
+			int errs;
+			if (ambe_classify(frame, &j->gamma, &errs) != AMBE_VOICE) {
+				if (j->voiced)
+					j->pending++;
+				j->done++;
+				continue;
+			}
+			if (j->sent > j->done) { //keep the order, after the frame in flight
+				v->fifo.after[j->fifotail] += j->pending;
+			} else {
+				for (int k = 0; k < j->pending; k++)
+					recorder_write(j->wavrec, pcm_silence, sizeof(pcm_silence));
+			}
+			j->pending = 0;
+			j->voiced = true;
+			memcpy(&ambebuf[6], frame, 9);
+			vocoder_send(v, ambebuf, sizeof(ambebuf));
+			j->fifotail = vocoder_fifo_push(&v->fifo, BACKFILL_SESSION, j->gen, j->sent);
+		}
+		if (j->done == j->nframes) {
+			printf("*** BACKFILL END (%s.wav, vocoder: %d, %d left) ***\n", j->path, i + 1, backfill_count);
+			backfill_files++;
+			backfill_frames += j->nframes;
+			backfill_end(j);
+			i--; //the next file starts on this channel now, not at the next wakeup
+		}
+	}
+}
+
+//bind a free vocoder channel, live streams and tx take it over from a backfill job.
+//NULL when every channel is busy, down or saturated.
+vocoder *vocoder_acquire(bool encode)
+{
+	vocoder *best = NULL;
+	for (int i = 0; i < vocoder_count; i++) {
+		vocoder *v = &vocoders[i];
+		if ( (v->users > 0) || v->down || (v->fifo.count > VOCODER_MAXINFLIGHT) || (encode && !v->backend->encodes) )
+			continue;
+		if ( (best == NULL) || (best->backfill.active && !v->backfill.active) )
+			best = v;
+	}
+	if (best == NULL)
+		return NULL;
+	if (best->backfill.active)
+		backfill_abort(best);
+	best->users++;
+	return best;
+}
+
+void vocoder_release(vocoder *v)
+{
+	if (v != NULL)
+		v->users--;
+}
+
+rx_session *rx_session_find(master *m, uint8_t slot, uint32_t streamid)
+{
+	for (int i = 0; i < MAX_RX_SESSIONS; i++) {
+		if (rx_sessions[i].active && (rx_sessions[i].host == m) && (rx_sessions[i].slot == slot) && (rx_sessions[i].streamid == streamid))
+			return &rx_sessions[i];
+	}
+	return NULL;
+}
+
+bool rx_slot_busy(master *m, uint8_t slot)
+{
+	for (int i = 0; i < MAX_RX_SESSIONS; i++) {
+		if (rx_sessions[i].active && (rx_sessions[i].host == m) && (rx_sessions[i].slot == slot))
+			return true;
+	}
+	return false;
+}
+
+rx_session *rx_session_alloc()
+{
+	for (int i = 0; i < MAX_RX_SESSIONS; i++) {
+		rx_session *s = &rx_sessions[i];
+		if (!s->active) {
+			uint32_t gen = s->gen + 1;
+			memset(s, 0, sizeof(rx_session));
+			s->gen = gen;
+			s->ambrec = -1;
+			s->wavrec = -1;
+			s->active = true;
+			return s;
+		}
+	}
+	return NULL;
+}
+
+//stop decoding a stream live, its ambe is still recorded and decoded by a backfill job after the call
+void rx_session_degrade(rx_session *s, const char *reason)
+{
+	if (s->degraded)
+		return;
+	recorder_close(s->wavrec); //partial file, rewritten by the backfill job
+	s->wavrec = -1;
+	s->queued = 0;
+	vocoder_release(s->voc);
+	s->voc = NULL;
+	s->degraded = true;
+	fprintf(stderr, "*** RX DEGRADED (slot: %d, srcid: %d): %s, recording ambe only ***\n", s->slot + 1, s->srcid, reason);
+}
+
+//send queued frames while the stream has room in its window, called as frames are queued and replies come back
+void rx_session_pump(rx_session *s)
+{
+	uint8_t ambebuf[4+2+9] = {0x61, 0x00, 2+9, 0x01,  0x01, 72};
+	for (; (s->voc != NULL) && (s->queued > 0) && (s->inflight < VOCODER_WINDOW); s->queued--) {
+		memcpy(&ambebuf[6], s->sendq[s->qhead], 9);
+		vocoder_send(s->voc, ambebuf, sizeof(ambebuf));
+		s->fifotail = vocoder_fifo_push(&s->voc->fifo, s - rx_sessions, s->gen, s->sentframes++);
+		s->voc->fifo.after[s->fifotail] = s->sendqafter[s->qhead];
+		s->inflight++;
+		s->qhead = (s->qhead + 1) % VOCODER_MAXINFLIGHT;
+	}
+}
+
+//record and decode one voice packet, ambe NULL for a lost one
+void rx_session_play(rx_session *s, const uint8_t *ambe)
+{
+	uint8_t fill[27];
+	if (ambe == NULL) { //silence keeps the recording time-aligned
+		for (int i = 0; i < 3; i++)
+			memcpy(&fill[i * 9], AMBE_SILENCE, 9);
+		ambe = fill;
+		s->lostframes += 3;
+	} else {
+		s->rxframes += 3;
+	}
+	recorder_write(s->ambrec, ambe, 27);
+	
+	if ( (s->voc != NULL) && (s->queued > VOCODER_MAXINFLIGHT - 3) )
+		rx_session_degrade(s, "vocoder saturated");
+	
+	//queue ambe frames for the ambeserver, rx_session_pump() sends them as the window allows.
+	//frames beyond repair and silent frames do not go to the vocoder: dropped before the first speech frame, otherwise
+	//held until speech follows and then written as silence, in order with the ones queued or at the vocoder. what is left at the end is trimmed
+	for (int i=0; i < 3; i++) {
+		const uint8_t *frame = &ambe[i * 9];
+		int errs;
+		int kind = ambe_classify(frame, &s->gamma, &errs);
+		s->ambeerrs += errs;
+		if (kind == AMBE_BAD)
+			s->badframes++;
+		if (kind != AMBE_VOICE) {
+			if (s->voiceframes > 0)
+				s->pending++;
+			continue;
+		}
+		s->voiceframes++;
+		if (s->queued > 0) {
+			s->sendqafter[(s->qhead + s->queued - 1) % VOCODER_MAXINFLIGHT] += s->pending;
+		} else if ( (s->voc != NULL) && (s->inflight > 0) ) {
+			s->voc->fifo.after[s->fifotail] += s->pending;
+		} else {
+			for (int k = 0; k < s->pending; k++)
+				recorder_write(s->wavrec, pcm_silence, sizeof(pcm_silence));
+		}
+		s->pending = 0;
+		if (s->voc == NULL)
+			continue;
+		int q = (s->qhead + s->queued++) % VOCODER_MAXINFLIGHT;
+		memcpy(s->sendq[q], frame, 9);
+		s->sendqafter[q] = 0;
+	}
+	rx_session_pump(s);
+}
+
+//play the packet due next, held or lost
+void rx_session_advance(rx_session *s)
+{
+	uint32_t bit = 1U << (s->nextseq % JITTER_DEPTH);
+	if (s->held & bit) {
+		rx_session_play(s, s->jitter[s->nextseq % JITTER_DEPTH]);
+		s->playing = true;
+	} else if (s->playing) { //lost
+		rx_session_play(s, NULL);
+	}
+	s->held &= ~bit;
+	s->nextseq++;
+}
+
+//voice packets are played in sequence order. duplicates are dropped, a late packet is waited for until
+//JITTER_DEPTH later ones have come in, then it is given up and played as silence
+void rx_session_voice(rx_session *s, uint8_t seq, const uint8_t *ambe)
+{
+	uint8_t ahead = seq - s->nextseq;
+	if (ahead >= 128) { //already played
+		s->dupframes += 3;
+		return;
+	}
+	for (; ahead >= JITTER_DEPTH; ahead--)
+		rx_session_advance(s);
+	uint32_t bit = 1U << (seq % JITTER_DEPTH);
+	if (s->held & bit) {
+		s->dupframes += 3;
+		return;
+	}
+	memcpy(s->jitter[seq % JITTER_DEPTH], ambe, 27);
+	s->held |= bit;
+	while (s->held & (1U << (s->nextseq % JITTER_DEPTH)))
+		rx_session_advance(s);
+}
+
+//play what is still held at the end of the stream, true if anything was
+bool rx_session_flush(rx_session *s)
+{
+	if (s->held == 0)
+		return false;
+	while (s->held != 0)
+		rx_session_advance(s);
+	return true;
+}
+
+void rx_session_close(rx_session *s)
+{
+	//the writer thread finalizes the wav header and closes the files
+	if (s->degraded && (s->ambrec != -1))
+		backfill_add(s->path, false);
+	recorder_close(s->ambrec);
+	s->ambrec = -1;
+	recorder_close(s->wavrec);
+	s->wavrec = -1;
+	printf("*** RX END (slot: %d, srcid: %d, ambeframes: %d, sent: %d, decoded: %d, vocoder lost: %d, speech: %d, ber: %.1f%%, bad frames: %d, lost: %d, duplicates: %d) ***\n", s->slot + 1, s->srcid,
+			s->rxframes, s->sentframes, s->ambefcnt, s->voclost, s->voiceframes, s->rxframes ? (100.0 * s->ambeerrs) / (s->rxframes * 46) : 0.0, s->badframes, s->lostframes, s->dupframes);
+	pipeline_stats();
+	vocoder_release(s->voc);
+	s->voc = NULL;
+	s->active = false;
+}
+
+FILE *tx_open_wav(const char *path)
+{
+	FILE *f = fopen(path , "rb");
+	if (f == NULL) {
+		fprintf(stderr, "failed to open %s file\n", path);
+		return NULL;
+	}
+	
+	wav_header tx_wavheader;
+	if ( fread(&tx_wavheader, 1, sizeof(tx_wavheader), f) != sizeof(tx_wavheader) ) {
+		fprintf(stderr, "invalid wav file\n");
+		fclose(f);
+		return NULL;
+	}
+	if (memcmp(tx_wavheader.data_header, "LIST", 4U) == 0) { //skip LIST chunk
+		fseek(f, tx_wavheader.data_bytes, SEEK_CUR);
+		if ( (fread(tx_wavheader.data_header, 1, sizeof(tx_wavheader.data_header), f) != sizeof(tx_wavheader.data_header))
+		  || (fread(&tx_wavheader.data_bytes, 1, sizeof(tx_wavheader.data_bytes), f) != sizeof(tx_wavheader.data_bytes)) )
+			memset(tx_wavheader.data_header, 0, sizeof(tx_wavheader.data_header));
+	}
+	if ( (memcmp(tx_wavheader.riff_header, "RIFF", 4U) != 0)
+	  || (memcmp(tx_wavheader.wave_header, "WAVE", 4U) != 0)
+	  || (memcmp(tx_wavheader.fmt_header,  "fmt ", 4U) != 0)
+	  || (memcmp(tx_wavheader.data_header, "data", 4U) != 0) ) {
+		fprintf(stderr, "invalid wav file\n");
+		fclose(f);
+		return NULL;
+	}
+	if ( (tx_wavheader.sample_rate != 8000) || (tx_wavheader.bit_depth != 16) || (tx_wavheader.num_channels != 1) ) {
+		fprintf(stderr, "wav file must be 8000Hz 16-bit mono\n");
+		fclose(f);
+		return NULL;
+	}
+	return f;
+}
+
+typedef struct txcache_t {
+	uint8_t key[32]; //sha256 of the pcm and the vocoder setup packets
+	uint8_t *pcm; //320 byte blocks of txmsg.wav
+	uint8_t *frames; //9 byte ambe frames, complete when ready
+	int nframes;
+	bool ready;
+	time_t mtime; //txmsg.wav as loaded
+	ino_t ino;
+	off_t size;
+	vocoder *voc; //while encoding
+	uint32_t gen;
+	int sent;
+	int done;
+	int64_t startt;
+} txcache;
+
+txcache				tx_cache;
+
+void txcache_free()
+{
+	free(tx_cache.pcm);
+	tx_cache.pcm = NULL;
+	free(tx_cache.frames);
+	tx_cache.frames = NULL;
+	tx_cache.nframes = 0;
+	tx_cache.ready = false;
+}
+
+//read txmsg.wav, and its ambe frames from the cache file when they were encoded from the same audio with the same settings
+void txcache_load()
+{
+	struct stat st;
+	if (stat(TXMSG_FILE, &st) == 0) { //remember even a bad file, so it is not read again until it changes
+		tx_cache.mtime = st.st_mtime;
+		tx_cache.ino = st.st_ino;
+		tx_cache.size = st.st_size;
+	}
+	FILE *f = tx_open_wav(TXMSG_FILE);
+	if (f == NULL)
+		return;
+	long datapos = ftell(f);
+	fseek(f, 0, SEEK_END);
+	int n = (ftell(f) - datapos) / 320;
+	fseek(f, datapos, SEEK_SET);
+	int keylen = n * 320 + sizeof(ambe_gain) + sizeof(ambe_ratep);
+	tx_cache.pcm = malloc(keylen);
+	tx_cache.frames = malloc(n * 9 + 1);
+	if ( (tx_cache.pcm == NULL) || (tx_cache.frames == NULL) || (fread(tx_cache.pcm, 320, n, f) != (size_t)n) ) {
+		fprintf(stderr, "failed to read %s\n", TXMSG_FILE);
+		fclose(f);
+		txcache_free();
+		return;
+	}
+	fclose(f);
+	tx_cache.nframes = n;
+	memcpy(tx_cache.pcm + n * 320, ambe_gain, sizeof(ambe_gain));
+	memcpy(tx_cache.pcm + n * 320 + sizeof(ambe_gain), ambe_ratep, sizeof(ambe_ratep));
+	sha256_generate((char *)tx_cache.pcm, keylen, (char *)tx_cache.key);
+	
+	f = fopen(TXCACHE_FILE, "rb");
+	if (f != NULL) {
+		uint8_t header[4+32];
+		if ( (fread(header, 1, sizeof(header), f) == sizeof(header)) && (memcmp(header, "AMBC", 4U) == 0)
+		  && (memcmp(&header[4], tx_cache.key, 32) == 0) && (fread(tx_cache.frames, 9, n, f) == (size_t)n) )
+			tx_cache.ready = true;
+		fclose(f);
+	}
+	if (tx_cache.ready)
+		printf("TX cache: %d frames from %s\n", n, TXCACHE_FILE);
+	else
+		printf("TX cache: %s changed, encoding %d frames\n", TXMSG_FILE, n);
+}
+
+void txcache_save()
+{
+	FILE *f = fopen(TXCACHE_FILE ".tmp", "wb");
+	if (f == NULL) {
+		fprintf(stderr, "failed to open %s file\n", TXCACHE_FILE ".tmp");
+		return;
+	}
+	bool ok = (fwrite("AMBC", 1, 4, f) == 4) && (fwrite(tx_cache.key, 1, 32, f) == 32)
+		&& (fwrite(tx_cache.frames, 9, tx_cache.nframes, f) == (size_t)tx_cache.nframes);
+	if ( (fclose(f) != 0) || !ok || (rename(TXCACHE_FILE ".tmp", TXCACHE_FILE) == -1) ) {
+		fprintf(stderr, "failed to write %s\n", TXCACHE_FILE);
+		unlink(TXCACHE_FILE ".tmp");
+	}
+}
+
+//the channel went away or lost replies, encode from the start on the next channel we get
+void txcache_abort()
+{
+	vocoder_release(tx_cache.voc);
+	tx_cache.voc = NULL;
+}
+
+//reload when txmsg.wav gets replaced, never in the middle of a tx
+void txcache_check()
+{
+	struct stat st;
+	if ( txactive || (stat(TXMSG_FILE, &st) == -1) )
+		return;
+	if ( (tx_cache.mtime == st.st_mtime) && (tx_cache.ino == st.st_ino) && (tx_cache.size == st.st_size) )
+		return;
+	txcache_abort();
+	txcache_free();
+	txcache_load();
+}
+
+//encode the prompt once, as fast as the channel replies, so tx playback needs no vocoder
+void txcache_run()
+{
+	if ( (tx_cache.pcm == NULL) || tx_cache.ready )
+		return;
+	if (tx_cache.voc == NULL) {
+		tx_cache.voc = vocoder_acquire(true);
+		if (tx_cache.voc == NULL)
+			return;
+		tx_cache.gen++;
+		tx_cache.sent = 0;
+		tx_cache.done = 0;
+		tx_cache.startt = now_ms();
+		vocoder_setup(tx_cache.voc);
+	}
+	uint8_t pcmbuf[4+2+320] = {0x61, 0x01, 0x42, 0x02,  0x00, 160};
+	for (; (tx_cache.sent < tx_cache.nframes) && (tx_cache.sent - tx_cache.done < TXCACHE_WINDOW); tx_cache.sent++) {
+		pcm_swap(&pcmbuf[6], &tx_cache.pcm[tx_cache.sent * 320], 160); //AMBE3000 uses MSB first
+		vocoder_send(tx_cache.voc, pcmbuf, sizeof(pcmbuf));
+		vocoder_fifo_push(&tx_cache.voc->fifo, TXCACHE_SESSION, tx_cache.gen, tx_cache.sent);
+	}
+	if (tx_cache.done == tx_cache.nframes) {
+		printf("TX cache: encoded %d frames in %d ms\n", tx_cache.nframes, (int)(now_ms() - tx_cache.startt));
+		txcache_save();
+		tx_cache.ready = true;
+		txcache_abort();
+	}
+}
+
+//replies that are not coming: their frames are written as silence, so recordings keep their length and every frame sent is accounted for
+void vocoder_fifo_fail(vocoder *v)
+{
+	vocoder_fifo *f = &v->fifo;
+	for (; f->count > 0; f->count--, f->head = (f->head + 1) % VOCODER_FIFO_SIZE) {
+		int i = f->head;
+		counter_add(&v->lostframes, 1);
+		if (f->session[i] == BACKFILL_SESSION) {
+			backfill_job *j = &v->backfill;
+			if ( !j->active || (j->gen != f->gen[i]) )
+				continue;
+			for (int k = 0; k <= f->after[i]; k++)
+				recorder_write(j->wavrec, pcm_silence, sizeof(pcm_silence));
+			j->done++;
+		} else if (f->session[i] < MAX_RX_SESSIONS) {
+			rx_session *s = &rx_sessions[f->session[i]];
+			if ( !s->active || (s->gen != f->gen[i]) )
+				continue;
+			for (int k = 0; k <= f->after[i]; k++)
+				recorder_write(s->wavrec, pcm_silence, sizeof(pcm_silence));
+			s->voclost++;
+			s->inflight--;
+		}
+	}
+}
+
+//replies overdue: a channel still sent to is down, otherwise the replies were lost and would shift every later match
+void vocoder_check(int64_t now)
+{
+	for (int i = 0; i < vocoder_count; i++) {
+		vocoder *v = &vocoders[i];
+		if ( (v->fifo.count == 0) || (now - v->fifo.waitt < VOCODER_TIMEOUT) )
+			continue;
+		vocoder_fifo_fail(v);
+		if (tx_cache.voc == v)
+			txcache_abort();
+		if (v->lastsend > v->lastrx) {
+			if (!v->down)
+				fprintf(stderr, "AMBEServer %s:%d not responding\n", v->url, v->port);
+			v->down = true;
+			for (int k = 0; k < MAX_RX_SESSIONS; k++) {
+				if (rx_sessions[k].active && (rx_sessions[k].voc == v))
+					rx_session_degrade(&rx_sessions[k], "vocoder not responding");
+			}
+			if (v->backfill.active)
+				backfill_abort(v);
+			vocoder_setup(v); //probe
+		}
+		else {
+			for (int k = 0; k < MAX_RX_SESSIONS; k++) {
+				if (rx_sessions[k].active && (rx_sessions[k].voc == v))
+					rx_session_pump(&rx_sessions[k]);
+			}
+		}
+	}
+}
+
+void process_dmr_packet(master *m, uint8_t *pkt, int len)
+{
+	dmrd_view d;
+	if((m->connect_status != CONNECTED_RW) && (memcmp(pkt, "RPTACK", 6U) == 0)){
+		master_set_status(m, process_connect(m, m->connect_status, pkt));
+	}
+	else if( (m->connect_status == CONNECTED_RW) && (memcmp(pkt, "MSTPONG", 7U) == 0) ){
+		m->pong_time = time(NULL);
+		if (m->pingt != 0)
+			histogram_add(&m->pingrtt, now_us() - m->pingt);
+		m->pingt = 0;
+	}
+	else if( (m->connect_status == CONNECTED_RW) && dmrd_parse(pkt, len, &d) ){
+		counter_add(&m->dmrdframes, 1);
+		rx_session *s = rx_session_find(m, d.slot, d.streamid);
+
+		if ( (d.frametype == DMRMMDVM_FRAMETYPE_DATASYNC) /*&& (d.calltype == 1)*/ ) {
+			if (d.n == MMDVM_SLOTTYPE_HEADER) {
+				//ignore duplicate header packets with the same stream id, voice follows the last one
+				if (s != NULL) {
+					if ( !s->playing && (s->held == 0) && ((uint8_t)(d.seq + 1 - s->nextseq) < 128) )
+						s->nextseq = d.seq + 1;
+					return;
+				}
+				s = rx_session_alloc();
+				if (s == NULL) {
+					fprintf(stderr, "no free rx session, ignoring stream from %d\n", d.srcid);
+					return;
+				}
+				s->host = m;
+				s->nextseq = d.seq + 1;
+				s->slot = d.slot;
+				s->streamid = d.streamid;
+				s->srcid = d.srcid;
+				s->dstid = d.dstid;
+				s->calltype = d.calltype;
+				
+				const char *cs = dmrids_lookup(d.srcid);
+				if (cs != NULL)
+					strcpy(s->callsign, cs);
+				
+				char filename[4096+100+5];
+				struct timeval tv;
+				gettimeofday(&tv, NULL);
+				struct tm *ptm = gmtime(&tv.tv_sec);
+				sprintf(s->path, "%s%04d-%02d-%02d_%02d.%02d.%02d.%03d_%d_%s", recpath, ptm->tm_year+1900, ptm->tm_mon+1, ptm->tm_mday,
+									ptm->tm_hour, ptm->tm_min, ptm->tm_sec, (int)(tv.tv_usec / 1000),  d.srcid, s->callsign);
+				
+				//raw ambe is always kept, so the wav can be decoded again later if the vocoder cannot keep up
+				sprintf(filename, "%s.ambe", s->path);
+				s->ambrec = recorder_open(filename, REC_RAW);
+				if (s->ambrec == -1) {
+					fprintf(stderr, "failed to open ambe file\n");
+				} else {
+					static const uint8_t header[] = {'A','M','B','E'};
+					recorder_write(s->ambrec, header, sizeof(header));
+				}
+				
+				s->voc = vocoder_acquire(false);
+				if (s->voc != NULL) {
+					sprintf(filename, "%s.wav", s->path);
+					s->wavrec = recorder_open(filename, REC_WAV);
+					if (s->wavrec == -1)
+						fprintf(stderr, "failed to open wav file\n");
+					pcm_level_init(&s->level);
+					vocoder_setup(s->voc);
+				}
+				
+				printf("*** RX START (master: %d, slot: %d, srcid: %d, callsign: %s, vocoder: %d) ***\n", (int)(m - masters) + 1, s->slot + 1, s->srcid, s->callsign,
+						(s->voc != NULL) ? (int)(s->voc - vocoders) + 1 : 0);
+				if (s->voc == NULL)
+					rx_session_degrade(s, "no vocoder channel free");
+				s->endt = rx_clock_ms() + 2000; //allow rx end without terminator, after extra timeout
+			}
+			else if ( (d.n == MMDVM_SLOTTYPE_TERMINATOR) && (s != NULL) ) {
+				rx_session_flush(s);
+				s->endt = rx_clock_ms() + 1000;
+			}
+		}
+
+		else if ( ((d.frametype == DMRMMDVM_FRAMETYPE_VOICE) || (d.frametype == DMRMMDVM_FRAMETYPE_VOICESYNC)) /*&& (d.calltype == 1)*/ ) {
+			if (s == NULL) //no header seen for this stream
+				return;
+			
+			uint8_t ambe[27];
+			dmrd_get_ambe(d.data, ambe);
+			rx_session_voice(s, d.seq, ambe);
+			
+			s->endt = rx_clock_ms() + 2000; //allow rx end without terminator, after extra timeout
+		}
+		
+	}
+}
+
+//rx sessions past their hang time are closed, and the reply to them is set up on their master
+void rx_end_check(int64_t now)
+{
+	for (int i = 0; i < MAX_RX_SESSIONS; i++) { //rx end
+		rx_session *s = &rx_sessions[i];
+		if ( !s->active || (now < s->endt) )
+			continue;
+		if (rx_session_flush(s)) { //no terminator, give the vocoder time for the packets held until now
+			s->endt = now + 1000;
+			continue;
+		}
+		if (s->inflight + s->queued > 0) { //the recording ends once every frame sent is decoded or given up by vocoder_check()
+			s->endt = now + TX_FRAME_INTERVAL;
+			continue;
+		}
+		rx_session_close(s);
+
+		master *m = s->host;
+		if (m->txpending || (txactive && (tx_master == m))) { //if there is a pending tx, ignore current rx
+			m->tx_startt = now + 1000; //wait a bit more before starting the pending tx
+			continue;
+		}
+		if (s->voiceframes < MIN_VOICE_FRAMES) //less than 1 sec. of speech
+			continue;
+		//char cmdstr[50];
+		//sprintf(cmdstr, "python3 -u dmrbot.py %d", s->srcid);
+		//if (system(cmdstr) != 0) {
+			//continue; //cancel tx if script fails
+			//fprintf(stderr, "dmrbot.py returned error, tx unavailable.wav file...\n");
+			//system("cat unavailable.wav > tx.wav");
+		//}
+		m->pong_time = time(NULL); //prevent timeout due to time spent on system() call
+		m->tx_startt = now + 1000; //wait a bit more before starting tx, allow rx to check if someone else tx
+		if (s->calltype == 1) { //private call
+			m->tx_tgid = s->srcid;
+			m->tx_calltype = 1;
+		} else { //group call
+			m->tx_tgid = m->tg;
+			m->tx_calltype = 0;
+		}
+		m->tx_slot = s->slot;
+		m->txpending = true;
+	}
+}
+
+void process_vocoder_packet(vocoder *v, uint8_t *pkt, int len)
+{
+	v->lastrx = now_ms();
+	if (v->down) {
+		v->down = false;
+		printf("AMBEServer %s:%d is back\n", v->url, v->port);
+	}
+	
+	if ((len == 4+2+320) && (pkt[0] == 0x61) && (pkt[3] == 0x02)) {
+		int sidx;
+		uint32_t sgen;
+		uint32_t frame;
+		int after;
+		counter_add(&v->pcmframes, 1);
+		bool popped = vocoder_fifo_pop(&v->fifo, &sidx, &sgen, &frame, &after);
+		if ( popped && (sidx == BACKFILL_SESSION) ) {
+			backfill_job *j = &v->backfill;
+			if ( !j->active || (j->gen != sgen) ) { //aborted job
+				counter_add(&v->pcmdrops, 1);
+				return;
+			}
+			pcm_level_apply(&j->level, &pkt[6], 160); //AMBE3000 uses MSB first
+			recorder_write(j->wavrec, &pkt[6], 320);
+			for (int i=0; i < after; i++)
+				recorder_write(j->wavrec, pcm_silence, sizeof(pcm_silence));
+			j->done++; //the silence after it was counted when it was skipped
+			return;
+		}
+		rx_session *s = (popped && (sidx < MAX_RX_SESSIONS)) ? &rx_sessions[sidx] : NULL;
+		if ( (s != NULL) && s->active && (s->gen == sgen) ) {
+			s->inflight--;
+			rx_session_pump(s);
+		}
+		if ( (s == NULL) || !s->active || (s->gen != sgen) || (s->wavrec == -1) ) { //if rx file not open, discard packet
+			counter_add(&v->pcmdrops, 1);
+#ifdef DEBUG
+			fprintf(stderr, "*** discarding pcm packet from ambeserver (session: %d, frame: %u) ***\n", popped ? sidx : -1, popped ? frame : 0);
+#endif
+			return;
+		}
+		pcm_level_apply(&s->level, &pkt[6], 160); //AMBE3000 uses MSB first
+		recorder_write(s->wavrec, &pkt[6], 320);
+		for (int i=0; i < after; i++)
+			recorder_write(s->wavrec, pcm_silence, sizeof(pcm_silence));
+		s->ambefcnt++;
+	}
+	else if ((len == 4+2+9) && (pkt[0] == 0x61) && (pkt[3] == 0x01)) {
+		int sidx;
+		uint32_t sgen;
+		uint32_t frame;
+		int after;
+		counter_add(&v->ambeframes, 1);
+		if ( !vocoder_fifo_pop(&v->fifo, &sidx, &sgen, &frame, &after) || (sidx != TXCACHE_SESSION) || (v != tx_cache.voc) || (sgen != tx_cache.gen) ) { //late packet of an aborted encoding
+			counter_add(&v->ambedrops, 1);
+#ifdef DEBUG
+			fprintf(stderr, "*** discarding ambe packet from ambeserver ***\n");
+#endif
+			return;
+		}
+		memcpy(&tx_cache.frames[tx_cache.done * 9], &pkt[6], 9);
+		tx_cache.done++;
+	}
+}
+
+typedef struct tx_burst_t {
+	uint8_t header[55];
+	uint8_t voice[6][55]; //superframe, sync or emb and embedded lc already in place, ambe payload left zero
+	uint8_t terminator[55];
+} tx_burst;
+
+tx_burst			txburst;
+
+void tx_send(const uint8_t *pkt)
+{
+	sendto(tx_host->sock, pkt, 55, 0, (const struct sockaddr *)&tx_host->addr, sizeof(tx_host->addr));
+#ifdef DEBUG
+	fprintf(stderr, "SEND DMR: ");
+	for(int i = 0; i < 55; ++i)
+		fprintf(stderr, "%02x ", pkt[i]);
+	fprintf(stderr, "\n");
+#endif
+}
+
+//everything that only depends on source, destination and call type is encoded once per tx stream
+void tx_burst_build()
+{
+	dmrd_builder b;
+	tx_srcid = dmr_srcid();
+	dmrd_builder_init(&b, tx_srcid, tx_tgid, dmrid, tx_slot, tx_calltype, tx_streamid);
+	
+	dmrd_build(&b, txburst.header, 0, DMRMMDVM_FRAMETYPE_DATASYNC, MMDVM_SLOTTYPE_HEADER);
+	generate_header(txburst.header);
+	
+	dmrd_build(&b, txburst.terminator, 0, DMRMMDVM_FRAMETYPE_DATASYNC, MMDVM_SLOTTYPE_TERMINATOR);
+	generate_header(txburst.terminator);
+	
+	uint8_t lc[9];
+	uint32_t emblc[4];
+	lc_build(lc, tx_calltype, tx_tgid, tx_srcid);
+	emb_lc_encode(lc, emblc);
+	for (int n = 0; n < 6; n++) {
+		uint8_t *pkt = txburst.voice[n];
+		if (n == 0) {
+			dmrd_build(&b, pkt, 0, DMRMMDVM_FRAMETYPE_VOICESYNC, n);
+			static const uint8_t sync_ms_voice[] = { 0x07,0xF7,0xD5,0xDD,0x57,0xDF,0xD0 };
+			pkt[33] = sync_ms_voice[0] & 0x0F;
+			memcpy(&pkt[34], &sync_ms_voice[1], 5);
+			pkt[39] = sync_ms_voice[6] & 0xF0;
+		} else {
+			dmrd_build(&b, pkt, 0, DMRMMDVM_FRAMETYPE_VOICE, n);
+			uint8_t lcss = emb_lc_put(pkt+DMRD_DATA, emblc, n);
+			get_emb_data(pkt+DMRD_DATA, lcss);
+		}
+	}
+}
+
+//send tx_ambefr as the voice frame of tx_ambefcnt, the third ambe frame in it
+void tx_send_voice()
+{
+	uint8_t pkt[DMRD_LEN];
+	int n = tx_ambefcnt / 3;
+	memcpy(pkt, txburst.voice[n % 6], DMRD_LEN);
+	pkt[DMRD_SEQ] = (n + 1) % 256;
+	dmrd_put_ambe(&pkt[DMRD_DATA], &tx_ambefr[0][0]);
+	tx_send(pkt);
+}
+
+typedef struct tx_request_t {
+	master *host;
+	int tgid;
+	uint8_t calltype;
+	uint8_t slot;
+	uint32_t streamid;
+} tx_request;
+
+//plays the cached prompt for each queued request, paced by the clock alone so main loop work cannot delay a frame.
+//tx_cache is not touched by the main loop while txactive is set
+void *tx_thread(void *arg)
+{
+	stage_pin("tx", CPU_TX);
+	while (1) {
+		tx_request *req = spsc_peek(&tx_ring);
+		if (req == NULL) {
+			spsc_wait(&tx_ring);
+			continue;
+		}
+		tx_host = req->host;
+		tx_tgid = req->tgid;
+		tx_calltype = req->calltype;
+		tx_slot = req->slot;
+		tx_streamid = req->streamid;
+		spsc_pop(&tx_ring);
+		
+		printf("*** TX START (master: %d) ***\n", (int)(tx_host - masters) + 1);
+		tx_burst_build();
+		tx_send(txburst.header);
+		
+		//first frame right away, then one every 20ms, the terminator in the slot after the last one
+		int64_t startt = now_us();
+		for (tx_ambefcnt = 0; tx_ambefcnt <= tx_cache.nframes; tx_ambefcnt++) {
+			int64_t at = startt + (int64_t)tx_ambefcnt * TX_FRAME_INTERVAL * 1000;
+			int64_t now = now_us();
+			if (now - at > 1000000) { //more than 1s late, do not burst to catch up
+				startt += now - at;
+				at = now;
+			}
+			if (at > now) {
+				struct timespec ts = { at / 1000000, (at % 1000000) * 1000 };
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+			}
+			if (tx_ambefcnt == tx_cache.nframes)
+				break;
+			memcpy(tx_ambefr[tx_ambefcnt % 3], &tx_cache.frames[tx_ambefcnt * 9], 9);
+			if ( (tx_ambefcnt % 3) == 2 )
+				tx_send_voice();
+		}
+		printf("*** TX END ***\n");
+		
+		uint8_t pkt[DMRD_LEN];
+		memcpy(pkt, txburst.terminator, DMRD_LEN);
+		pkt[DMRD_SEQ] = ((tx_ambefcnt / 3) + 1) % 256;
+		tx_send(pkt);
+		eventfd_write(txdonefd, 1);
+	}
+	return NULL;
+}
+
+//AMBEServerIP:PORT[,AMBEServerIP:PORT...], the list is split in place
+bool ambeserver_open(vocoder *v)
+{
+	if ((v->sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0) {
+		perror("cannot create socket");
+		return false;
+	}
+	memset((char *)&v->addr, 0, sizeof(v->addr));
+	v->addr.sin_family = AF_INET;
+	v->addr.sin_port = htons(v->port);
+	struct hostent *hp = gethostbyname(v->url);
+	if (!hp) {
+		fprintf(stderr, "could not resolve %s\n", v->url);
+		return false;
+	}
+	memcpy((void *)&v->addr.sin_addr, hp->h_addr_list[0], hp->h_length);
+	return true;
+}
+
+void ambeserver_flush(vocoder *v)
+{
+	udp_flush(v->sock, &v->txq);
+}
+
+int ambeserver_recv(vocoder *v, udp_batch *b)
+{
+	return udp_recv_batch(v->sock, b);
+}
+
+const vocoder_backend ambeserver_backend = {ambeserver_open, ambeserver_flush, ambeserver_recv, true};
+
+#ifdef HAVE_MBELIB
+//software ambe+2 decoder, one worker thread per channel: a channel carries one stream at a time and its decoder state
+//runs across the frames, the channels decode in parallel. there is no encoder, the tx prompt needs an AMBEServer
+typedef struct mbe_packet_t {
+	uint16_t len;
+	uint8_t data[4+2+320];
+} mbe_packet;
+
+typedef struct mbe_worker_t {
+	spsc_ring requests; //main loop to worker
+	spsc_ring replies; //worker to main loop, its eventfd is the channel's sock
+	mbe_parms cur;
+	mbe_parms prev;
+	mbe_parms prev_enhanced;
+	float gain; //decoder gain of the last gain packet, as a factor
+} mbe_worker;
+
+void mbe_decode(mbe_worker *w, const uint8_t *frame, uint8_t *pcm)
+{
+	char fr[4][24];
+	char d[49];
+	char errstr[64];
+	float out[160];
+	int errs, errs2;
+	memset(fr, 0, sizeof(fr));
+	for (unsigned int i = 0U; i < 36U; i++) {
+		uint8_t dibit = (frame[i / 4U] >> (6U - 2U * (i % 4U))) & 3U;
+		fr[AMBE_W[i]][AMBE_X[i]] = dibit >> 1;
+		fr[AMBE_Y[i]][AMBE_Z[i]] = dibit & 1U;
+	}
+	mbe_processAmbe3600x2450Framef(out, &errs, &errs2, errstr, fr, d, &w->cur, &w->prev, &w->prev_enhanced, 3);
+	for (int i = 0; i < 160; i++) {
+		float x = out[i] * 7.0f * w->gain; //the scale of mbe_floattoshort()
+		int16_t sample = (x > 32767.0f) ? 32767 : (x < -32768.0f) ? -32768 : (int16_t)x;
+		pcm[2 * i] = (uint16_t)sample >> 8; //MSB first, as from the AMBE3000
+		pcm[2 * i + 1] = sample & 0xff;
+	}
+}
+
+void *mbe_thread(void *arg)
+{
+	mbe_worker *w = ((vocoder *)arg)->worker;
+	mbe_initMbeParms(&w->cur, &w->prev, &w->prev_enhanced);
+	w->gain = 1.0f;
+	while (1) {
+		spsc_wait(&w->requests);
+		for (mbe_packet *p = spsc_peek(&w->requests); p != NULL; p = spsc_peek(&w->requests)) {
+			mbe_packet *r = spsc_slot(&w->replies, 0); //only full if the main loop stopped draining, the frame is then lost as on udp
+			if ( (r != NULL) && (p->data[3] == 0x01) && (p->len == 4+2+9) ) {
+				static const uint8_t h[] = {0x61, 0x01, 0x42, 0x02, 0x00, 160};
+				memcpy(r->data, h, sizeof(h));
+				mbe_decode(w, &p->data[6], &r->data[6]);
+				r->len = 4+2+320;
+				spsc_push(&w->replies);
+			} else if ( (r != NULL) && (p->data[3] == 0x00) ) { //control: a rate setup starts a new stream, the gain packet sets the decoder gain
+				if (p->data[4] == 0x0A)
+					mbe_initMbeParms(&w->cur, &w->prev, &w->prev_enhanced);
+				if ( (p->data[4] == 0x4B) && (p->len >= 7) )
+					w->gain = powf(10.0f, (int8_t)p->data[6] / 20.0f);
+				static const uint8_t h[] = {0x61, 0x00, 0x02, 0x00};
+				memcpy(r->data, h, sizeof(h));
+				r->data[4] = p->data[4];
+				r->data[5] = 0x00;
+				r->len = 4+2;
+				spsc_push(&w->replies);
+			}
+			spsc_pop(&w->requests);
+		}
+		spsc_kick(&w->replies);
+	}
+	return NULL;
+}
+
+bool mbe_open(vocoder *v)
+{
+	pthread_t th;
+	v->worker = calloc(1, sizeof(mbe_worker));
+	if ( (v->worker == NULL) || !spsc_init(&v->worker->requests, "mbe", MBE_QUEUE, sizeof(mbe_packet))
+	  || !spsc_init(&v->worker->replies, "mbe", MBE_QUEUE, sizeof(mbe_packet)) ) {
+		fprintf(stderr, "cannot allocate software decoder\n");
+		return false;
+	}
+	v->sock = v->worker->replies.efd;
+	if ( (pthread_create(&th, NULL, mbe_thread, v) != 0) || (pthread_detach(th) != 0) ) {
+		fprintf(stderr, "failed to start software decoder thread\n");
+		return false;
+	}
+	return true;
+}
+
+void mbe_flush(vocoder *v)
+{
+	for (int i = 0; i < v->txq.count; i++) {
+		mbe_packet *p = spsc_slot(&v->worker->requests, 0);
+		if (p == NULL) //counted, the fifo gives the frame up like a lost reply
+			continue;
+		p->len = v->txq.iov[i].iov_len;
+		memcpy(p->data, v->txq.data[i], p->len);
+		spsc_push(&v->worker->requests);
+	}
+	v->txq.count = 0;
+	spsc_kick(&v->worker->requests);
+}
+
+int mbe_recv(vocoder *v, udp_batch *b)
+{
+	spsc_ring *r = &v->worker->replies;
+	spsc_ack(r);
+	int n = 0;
+	for (mbe_packet *p = spsc_peek(r); (p != NULL) && (n < UDP_BATCH); p = spsc_peek(r), n++) {
+		memcpy(b->data[n], p->data, p->len);
+		b->msgs[n].msg_len = p->len;
+		b->addr[n] = v->addr;
+		spsc_pop(r);
+	}
+	if (spsc_peek(r) != NULL) //more than a batch, come back for the rest
+		eventfd_write(r->efd, 1);
+	return n;
+}
+
+const vocoder_backend mbe_backend = {mbe_open, mbe_flush, mbe_recv, false};
+#endif
+
+//AMBEServerIP:PORT, or mbelib[:CHANNELS] for software decoder channels, one per spare cpu by default
+bool vocoders_parse(char *list)
+{
+	char *saveptr;
+	for (char *tok = strtok_r(list, ",", &saveptr); tok != NULL; tok = strtok_r(NULL, ",", &saveptr)) {
+		char *port = strchr(tok, ':');
+		size_t namelen = (port != NULL) ? (size_t)(port - tok) : strlen(tok);
+		if ( (namelen == 6) && (strncmp(tok, "mbelib", 6) == 0) ) {
+#ifdef HAVE_MBELIB
+			int n = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+			if (port != NULL)
+				n = atoi(port + 1);
+			else if (n > MAX_VOCODERS - vocoder_count)
+				n = MAX_VOCODERS - vocoder_count;
+			else if (n < 1)
+				n = 1;
+			if ( (n < 1) || (vocoder_count + n > MAX_VOCODERS) ) {
+				fprintf(stderr, "invalid software decoder channels %s, max %d vocoders\n", tok, MAX_VOCODERS);
+				return false;
+			}
+			for (int i = 0; i < n; i++, vocoder_count++) {
+				vocoders[vocoder_count].url = "mbelib";
+				vocoders[vocoder_count].port = i + 1;
+				vocoders[vocoder_count].backend = &mbe_backend;
+			}
+			printf("Software decoder: mbelib, %d channels\n", n);
+			continue;
+#else
+			fprintf(stderr, "built without mbelib, software decoder unavailable\n");
+			return false;
+#endif
+		}
+		if (vocoder_count == MAX_VOCODERS) {
+			fprintf(stderr, "too many AMBEServers, max %d\n", MAX_VOCODERS);
+			return false;
+		}
+		if (port == NULL) {
+			fprintf(stderr, "invalid AMBEServer %s\n", tok);
+			return false;
+		}
+		*port++ = '\0';
+		vocoders[vocoder_count].url = tok;
+		vocoders[vocoder_count].port = atoi(port);
+		vocoders[vocoder_count].backend = &ambeserver_backend;
+		printf("AMBEServer: %s:%d\n", vocoders[vocoder_count].url, vocoders[vocoder_count].port);
+		vocoder_count++;
+	}
+	if (vocoder_count == 0) {
+		fprintf(stderr, "no AMBEServer given\n");
+		return false;
+	}
+	return true;
+}
+
+bool vocoders_open()
+{
+	for (int i = 0; i < vocoder_count; i++) {
+		if (!vocoders[i].backend->open(&vocoders[i]))
+			return false;
+	}
+	return true;
+}
+
+//DMRHostIP:PORT:TG:PW[,DMRHostIP:PORT:TG:PW...], the list is split in place
+bool masters_parse(char *list)
+{
+	char *saveptr;
+	for (char *tok = strtok_r(list, ",", &saveptr); tok != NULL; tok = strtok_r(NULL, ",", &saveptr)) {
+		if (master_count == MAX_MASTERS) {
+			fprintf(stderr, "too many DMR masters, max %d\n", MAX_MASTERS);
+			return false;
+		}
+		master *m = &masters[master_count];
+		char *port = strchr(tok, ':');
+		char *tg = (port != NULL) ? strchr(port + 1, ':') : NULL;
+		char *pw = (tg != NULL) ? strchr(tg + 1, ':') : NULL;
+		if (pw == NULL) {
+			fprintf(stderr, "invalid DMR master %s\n", tok);
+			return false;
+		}
+		*port++ = '\0';
+		*tg++ = '\0';
+		*pw++ = '\0';
+		m->url = tok;
+		m->port = atoi(port);
+		m->tg = atoi(tg);
+		m->pw = pw;
+		m->connect_status = DISCONNECTED;
+		printf("DMR: %s:%d\n", m->url, m->port);
+		master_count++;
+	}
+	if (master_count == 0) {
+		fprintf(stderr, "no DMR master given\n");
+		return false;
+	}
+	return true;
+}
+
+bool masters_open()
+{
+	for (int i = 0; i < master_count; i++) {
+		if ((masters[i].sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0) {
+			perror("cannot create socket");
+			return false;
+		}
+		memset((char *)&masters[i].addr, 0, sizeof(masters[i].addr));
+		masters[i].addr.sin_family = AF_INET;
+		masters[i].addr.sin_port = htons(masters[i].port);
+		struct hostent *hp = gethostbyname(masters[i].url);
+		if (!hp) {
+			fprintf(stderr, "could not resolve %s\n", masters[i].url);
+			return false;
+		}
+		memcpy((void *)&masters[i].addr.sin_addr, hp->h_addr_list[0], hp->h_length);
+	}
+	return true;
+}
+
+master *master_find(int sock)
+{
+	for (int i = 0; i < master_count; i++) {
+		if (masters[i].sock == sock)
+			return &masters[i];
+	}
+	return NULL;
+}
+
+//--capture keeps every datagram from the masters and the AMBEServers, for --replay.
+//the file is CAPTURE_MAGIC and the master count, then per datagram: us since the previous one, source, length, data. little endian.
+//the source is the master index, or CAPTURE_VOCODER + the vocoder index. gaps over an hour are shortened
+#define CAPTURE_MAGIC "DMRVCAP1"
+#define CAPTURE_VOCODER 0x80
+#define CAPTURE_RECORD 7
+
+FILE				*capture_file = NULL;
+pthread_mutex_t		capture_lock = PTHREAD_MUTEX_INITIALIZER; //the net thread writes the masters, the main loop the vocoders
+int64_t				capture_lastt;
+
+bool capture_open(const char *path)
+{
+	capture_file = fopen(path, "wb");
+	if (capture_file == NULL) {
+		fprintf(stderr, "cannot create capture %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	setvbuf(capture_file, NULL, _IOFBF, 1 << 16);
+	fwrite(CAPTURE_MAGIC, 1, 8, capture_file);
+	fputc(master_count, capture_file);
+	capture_lastt = now_us();
+	printf("Capture to: %s\n", path);
+	return true;
+}
+
+void capture_write(int source, const uint8_t *data, int len)
+{
+	uint8_t h[CAPTURE_RECORD];
+	pthread_mutex_lock(&capture_lock);
+	int64_t t = now_us();
+	int64_t dt = t - capture_lastt;
+	capture_lastt = t;
+	store32le(h, (dt > 0xffffffffLL) ? 0xffffffffU : (uint32_t)dt);
+	h[4] = source;
+	store16le(&h[5], len);
+	fwrite(h, 1, sizeof(h), capture_file);
+	fwrite(data, 1, len, capture_file);
+	pthread_mutex_unlock(&capture_lock);
+}
+
+void capture_flush()
+{
+	pthread_mutex_lock(&capture_lock);
+	fflush(capture_file);
+	pthread_mutex_unlock(&capture_lock);
+}
+
+typedef struct net_packet_t {
+	master *host;
+	uint32_t from; //sender address
+	uint16_t len;
+	uint8_t data[UDP_BATCH_PKTSIZE];
+} net_packet;
+
+//receives from the masters and queues the packets for the main loop, so a busy main loop does not hold up the sockets
+void *net_thread(void *arg)
+{
+	stage_pin("net", CPU_NET);
+	static udp_batch netbatch;
+	int epfd = epoll_create1(0);
+	for (int i = 0; i < master_count; i++)
+		epoll_add(epfd, masters[i].sock);
+	while (1) {
+		struct epoll_event events[MAX_MASTERS];
+		int nev = epoll_wait(epfd, events, MAX_MASTERS, -1);
+		for (int e = 0; e < nev; e++) {
+			master *m = master_find(events[e].data.fd);
+			for (int batch = 0; batch < UDP_RX_BATCHES; batch++) {
+				int nmsg = udp_recv_batch(m->sock, &netbatch);
+				for (int k = 0; k < nmsg; k++) {
+					if ( (capture_file != NULL) && (netbatch.msgs[k].msg_len > 0) && (netbatch.addr[k].sin_addr.s_addr == m->addr.sin_addr.s_addr) )
+						capture_write(m - masters, netbatch.data[k], netbatch.msgs[k].msg_len);
+					net_packet *p = spsc_slot(&net_ring, 0);
+					if (p == NULL) //counted, the main loop is too far behind
+						continue;
+					p->host = m;
+					p->from = netbatch.addr[k].sin_addr.s_addr;
+					p->len = netbatch.msgs[k].msg_len;
+					memcpy(p->data, netbatch.data[k], p->len);
+					spsc_push(&net_ring);
+				}
+				if (nmsg < UDP_BATCH)
+					break;
+			}
+		}
+		spsc_kick(&net_ring);
+	}
+	return NULL;
+}
+
+void vocoder_drain(vocoder *v)
+{
+	for (int batch = 0; batch < UDP_RX_BATCHES; batch++) {
+		int nmsg = v->backend->recv(v, &rxbatch);
+		for (int m = 0; m < nmsg; m++) {
+			if ( (rxbatch.msgs[m].msg_len > 0) && (rxbatch.addr[m].sin_addr.s_addr == v->addr.sin_addr.s_addr) )
+				process_vocoder_packet(v, rxbatch.data[m], rxbatch.msgs[m].msg_len);
+		}
+		if (nmsg < UDP_BATCH)
+			break;
+	}
+}
+
+//dmrvmsg --decode: decode stored .ambe captures into .wav files next to them, as fast as the AMBEServers reply.
+//each file goes to one channel, the decoder state runs across frames, files are spread over the channels.
+int decode_main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: dmrvmsg --decode [AMBEServerIP:PORT[,AMBEServerIP:PORT...]] [--window FRAMES] [--gain DB] [--agc] [FILE.ambe...]\n");
+		return 1;
+	}
+	if (!vocoders_parse(argv[0]) || !vocoders_open())
+		return 1;
+	int first = 1;
+	backfill_window = DECODE_WINDOW;
+	while (first < argc) {
+		if ( (first + 1 < argc) && (strcmp(argv[first], "--window") == 0) ) {
+			backfill_window = atoi(argv[first + 1]);
+			first += 2;
+			if ( (backfill_window < 1) || (backfill_window > VOCODER_MAXINFLIGHT) ) {
+				fprintf(stderr, "window must be 1 to %d frames\n", VOCODER_MAXINFLIGHT);
+				return 1;
+			}
+			continue;
+		}
+		int used = pcm_option(argc, argv, first);
+		if (used == -1)
+			return 1;
+		if (used == 0)
+			break;
+		first += used;
+	}
+	if (!recorder_start()) {
+		fprintf(stderr, "failed to start recorder thread\n");
+		return 1;
+	}
+	int epfd = epoll_create1(0);
+	if (epfd == -1) {
+		perror("cannot create event descriptors");
+		return 1;
+	}
+	for (int i = 0; i < vocoder_count; i++)
+		epoll_add(epfd, vocoders[i].sock);
+	
+	int64_t startt = now_ms();
+	int64_t probet = startt + PING_INTERVAL;
+	int64_t lastrx = startt;
+	int next = first;
+	while (1) {
+		for (; (next < argc) && (backfill_count < BACKFILL_QUEUE); next++) { //the queue takes the file list a part at a time
+			size_t len = strlen(argv[next]);
+			if ( (len < 5) || (strcmp(&argv[next][len - 5], ".ambe") != 0) ) {
+				fprintf(stderr, "%s is not an .ambe file\n", argv[next]);
+				backfill_failed++;
+				continue;
+			}
+			argv[next][len - 5] = '\0';
+			backfill_add(argv[next], false);
+		}
+		backfill_run();
+		vocoder_flush();
+		recorder_kick();
+		bool busy = (backfill_count > 0);
+		for (int i = 0; i < vocoder_count; i++) {
+			busy |= vocoders[i].backfill.active;
+			if (vocoders[i].lastrx > lastrx)
+				lastrx = vocoders[i].lastrx;
+		}
+		if ( !busy && (next == argc) )
+			break;
+		
+		struct epoll_event events[MAX_VOCODERS];
+		int nev = epoll_wait(epfd, events, MAX_VOCODERS, 1000);
+		if ( (nev == -1) && (errno != EINTR) ) {
+			perror("epoll_wait");
+			return 1;
+		}
+		for (int e = 0; e < nev; e++)
+			vocoder_drain(vocoder_find(events[e].data.fd));
+		
+		int64_t now = now_ms();
+		vocoder_check(now);
+		if (now >= probet) {
+			for (int i = 0; i < vocoder_count; i++) {
+				if (vocoders[i].down)
+					vocoder_setup(&vocoders[i]);
+			}
+			probet = now + PING_INTERVAL;
+		}
+		if (now - lastrx > TIMEOUT * 1000) {
+			fprintf(stderr, "no reply from any AMBEServer, giving up\n");
+			return 1;
+		}
+	}
+	recorder_drain();
+	int ms = now_ms() - startt;
+	printf("Decoded %d files, %llu frames in %d ms (%.1fx real time), %d failed\n", backfill_files, (unsigned long long)backfill_frames,
+			ms, (ms > 0) ? (backfill_frames * 20.0) / ms : 0.0, backfill_failed);
+	return (backfill_failed > 0) ? 1 : 0;
+}
+
+//next datagram of a capture, false at its end
+bool capture_read(FILE *f, int64_t *dt, int *source, uint8_t *data, int *len)
+{
+	uint8_t h[CAPTURE_RECORD];
+	if (fread(h, 1, sizeof(h), f) != sizeof(h))
+		return false;
+	*dt = h[0] | (h[1] << 8) | (h[2] << 16) | ((uint32_t)h[3] << 24);
+	*source = h[4];
+	*len = h[5] | (h[6] << 8);
+	if ( (*len > UDP_BATCH_PKTSIZE) || (fread(data, 1, *len, f) != (size_t)*len) ) {
+		fprintf(stderr, "capture is truncated\n");
+		return false;
+	}
+	return true;
+}
+
+//at max speed a stream is fed no faster than its vocoder decodes it, calls are not degraded by the replay itself
+bool replay_backlog()
+{
+	for (int i = 0; i < MAX_RX_SESSIONS; i++) {
+		if ( rx_sessions[i].active && (rx_sessions[i].queued > 0) )
+			return true;
+	}
+	return false;
+}
+
+//dmrvmsg --replay: feed a --capture back into the rx path, at its own pace, N times faster or as fast as the vocoders decode.
+//the rx clock follows the capture, so hang times and the replies picked are the ones of the live run. nothing is sent to the masters
+int replay_main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: dmrvmsg --replay [AMBEServerIP:PORT[,AMBEServerIP:PORT...]] [--speed N|max] [--gain DB] [--agc] [FILE] [SavePath]\n");
+		return 1;
+	}
+	if (!vocoders_parse(argv[0]) || !vocoders_open())
+		return 1;
+	double speed = 1; //0 for max
+	int first = 1;
+	while (first < argc) {
+		if ( (first + 1 < argc) && (strcmp(argv[first], "--speed") == 0) ) {
+			speed = (strcmp(argv[first + 1], "max") == 0) ? 0 : atof(argv[first + 1]);
+			if ( (speed == 0) && (strcmp(argv[first + 1], "max") != 0) ) {
+				fprintf(stderr, "speed must be a factor over 0, or max\n");
+				return 1;
+			}
+			first += 2;
+			continue;
+		}
+		int used = pcm_option(argc, argv, first);
+		if (used == -1)
+			return 1;
+		if (used == 0)
+			break;
+		first += used;
+	}
+	if (first == argc) {
+		fprintf(stderr, "no capture given\n");
+		return 1;
+	}
+	FILE *f = fopen(argv[first], "rb");
+	char magic[8];
+	int count;
+	if ( (f == NULL) || (fread(magic, 1, 8, f) != 8) || (memcmp(magic, CAPTURE_MAGIC, 8) != 0) || ((count = fgetc(f)) < 1) || (count > MAX_MASTERS) ) {
+		fprintf(stderr, "%s is not a capture\n", argv[first]);
+		return 1;
+	}
+	//the masters stand for the ones captured, logged in already and without a socket
+	for (master_count = 0; master_count < count; master_count++) {
+		master *m = &masters[master_count];
+		m->url = argv[first];
+		m->port = master_count + 1;
+		m->sock = -1;
+		m->connect_status = CONNECTED_RW;
+	}
+	if (first + 1 < argc)
+		snprintf(recpath, sizeof(recpath) - 1, "%s", argv[first + 1]);
+	else
+		strcpy(recpath, ".");
+	if (recpath[strlen(recpath)-1] != '/')
+		recpath[strlen(recpath)] = '/';
+	
+	if (!recorder_start()) {
+		fprintf(stderr, "failed to start recorder thread\n");
+		return 1;
+	}
+	dmrids = dmrids_load(DMRIDS_FILE);
+	if (dmrids == NULL)
+		fprintf(stderr, "failed to load %s, no callsigns\n", DMRIDS_FILE);
+	int epfd = epoll_create1(0);
+	if (epfd == -1) {
+		perror("cannot create event descriptors");
+		return 1;
+	}
+	for (int i = 0; i < vocoder_count; i++)
+		epoll_add(epfd, vocoders[i].sock);
+	
+	static uint8_t data[UDP_BATCH_PKTSIZE];
+	int64_t dt, capt = 0; //us into the capture
+	int source, len;
+	bool more = capture_read(f, &dt, &source, data, &len);
+	capt += more ? dt : 0;
+	uint64_t packets = 0;
+	int replies = 0;
+	int64_t startt = now_ms();
+	int64_t startus = now_us();
+	while (1) {
+		for (; more; more = capture_read(f, &dt, &source, data, &len), capt += more ? dt : 0) {
+			if ( (speed > 0) && (now_us() < startus + (int64_t)(capt / speed)) )
+				break;
+			if ( (speed == 0) && replay_backlog() )
+				break;
+			rx_clock_advance(startt + capt / 1000);
+			rx_end_check(rx_clock_ms());
+			if (source < master_count)
+				process_dmr_packet(&masters[source], data, len);
+			packets++;
+		}
+		if (speed > 0) //the clock runs the capture's pace between packets too
+			rx_clock_advance(startt + (int64_t)((now_us() - startus) * speed / 1000));
+		
+		//sleep until the next packet is due or a hang time runs out, replies wake it up earlier
+		int64_t waitt = TX_FRAME_INTERVAL; //polls the last calls and backfills to their end
+		if ( more && (speed > 0) )
+			waitt = (startus + (int64_t)(capt / speed) - now_us() + 999) / 1000;
+		else if ( more && !replay_backlog() )
+			waitt = 0;
+		bool active = false;
+		for (int i = 0; i < MAX_RX_SESSIONS; i++) {
+			rx_session *s = &rx_sessions[i];
+			if (!s->active)
+				continue;
+			active = true;
+			if ( !more && (s->inflight + s->queued == 0) ) //nothing more comes in, no use waiting for the hang time
+				rx_clock_advance(s->endt);
+			int64_t t = (s->endt - rx_clock_ms()) / ((speed > 0) ? speed : 1);
+			if (t < waitt)
+				waitt = (t > 0) ? t : 0;
+		}
+		struct epoll_event events[MAX_VOCODERS];
+		int nev = epoll_wait(epfd, events, MAX_VOCODERS, waitt);
+		if ( (nev == -1) && (errno != EINTR) ) {
+			perror("epoll_wait");
+			return 1;
+		}
+		for (int e = 0; e < nev; e++)
+			vocoder_drain(vocoder_find(events[e].data.fd));
+		
+		vocoder_check(now_ms());
+		rx_end_check(rx_clock_ms());
+		for (int i = 0; i < master_count; i++) {
+			if (masters[i].txpending) { //counted only, the prompt went out in the live run
+				masters[i].txpending = false;
+				replies++;
+			}
+		}
+		backfill_run();
+		vocoder_flush();
+		recorder_kick();
+		bool busy = active || (backfill_count > 0);
+		for (int i = 0; i < vocoder_count; i++)
+			busy |= vocoders[i].backfill.active;
+		if ( !more && !busy )
+			break;
+	}
+	fclose(f);
+	recorder_drain();
+	int ms = now_ms() - startt;
+	uint64_t frames = 0;
+	for (int i = 0; i < vocoder_count; i++)
+		frames += vocoders[i].pcmframes;
+	printf("Replayed %llu packets, %d ms of capture in %d ms (%.1fx real time), %llu frames decoded (%.0f frames/s), %d replies\n",
+			(unsigned long long)packets, (int)(capt / 1000), ms, (ms > 0) ? (double)capt / 1000 / ms : 0.0,
+			(unsigned long long)frames, (ms > 0) ? frames * 1000.0 / ms : 0.0, replies);
+	return 0;
+}
+
+#define MOCK_QUEUE 1024 //replies held back per channel, as many as a vocoder fifo
+
+typedef struct mock_reply_t {
+	int64_t due; //now_us()
+	struct sockaddr_in to;
+	uint16_t len;
+	uint8_t data[4+2+320];
+} mock_reply;
+
+typedef struct mock_channel_t {
+	int sock;
+	uint32_t rand; //xorshift, seeded per channel so loss and jitter do not depend on the other channels
+	int gamma; //decoder gain, followed as ambe_classify() does
+	uint32_t phase;
+	mock_reply *queue;
+	int head;
+	int count;
+	int64_t lastdue;
+} mock_channel;
+
+uint32_t mock_rand(mock_channel *c)
+{
+	c->rand ^= c->rand << 13;
+	c->rand ^= c->rand >> 17;
+	c->rand ^= c->rand << 5;
+	return c->rand;
+}
+
+//synthetic pcm for a frame, big endian: a triangle wave at the frame's pitch and gain, zero for silence and bad frames
+void mock_decode(mock_channel *c, const uint8_t *frame, uint8_t *pcm)
+{
+	uint32_t v[4];
+	int errs;
+	memset(pcm, 0, 320);
+	if (ambe_classify(frame, &c->gamma, &errs) != AMBE_VOICE)
+		return;
+	ambe_vectors(frame, v);
+	int period = 20 + ambe_b0(v) * 103 / 119; //samples, about the 20 to 123 of the codec
+	int level = c->gamma / 16;
+	int amp = 64 << ((level > 8) ? 8 : (level < 0) ? 0 : level);
+	for (int i = 0; i < 160; i++, c->phase++) {
+		int p = c->phase % period;
+		int x = (p < period - p) ? p : period - p; //0 to period/2 and back
+		int16_t sample = x * 2 * amp / (period / 2) - amp;
+		pcm[2 * i] = (uint16_t)sample >> 8;
+		pcm[2 * i + 1] = sample & 0xff;
+	}
+}
+
+//synthetic ambe for a pcm frame: the silence code for quiet frames, otherwise a hash of the pcm. not valid fec, it only has to be repeatable
+void mock_encode(const uint8_t *pcm, uint8_t *frame)
+{
+	int peak = 0;
+	uint32_t h = 2166136261U;
+	for (int i = 0; i < 160; i++) {
+		int16_t sample = (pcm[2 * i] << 8) | pcm[2 * i + 1];
+		if (abs(sample) > peak)
+			peak = abs(sample);
+		h = (h ^ pcm[2 * i] ^ (pcm[2 * i + 1] << 8)) * 16777619U;
+	}
+	if (peak < AGC_FLOOR) {
+		memcpy(frame, AMBE_SILENCE, 9);
+		return;
+	}
+	for (int i = 0; i < 9; i++) {
+		h = (h ^ i) * 16777619U;
+		frame[i] = h >> 24;
+	}
+}
+
+//dmrvmsg --mock-ambeserver: a stand-in for AMBEServers on PORT and the ports above it, one channel each, for tests and load runs without a DV3000.
+//replies keep their order, as on the serial line of a real one. latency and jitter are in ms, loss is the fraction of replies never sent
+int mock_main(int argc, char **argv)
+{
+	int channels = 1;
+	int latency = 0;
+	int jitter = 0;
+	double loss = 0;
+	uint32_t seed = 1;
+	int port = 2460;
+	int first = 0;
+	while (first < argc) {
+		if (first + 1 == argc) {
+			port = atoi(argv[first]);
+			break;
+		}
+		const char *val = argv[first + 1];
+		if (strcmp(argv[first], "--channels") == 0)
+			channels = atoi(val);
+		else if (strcmp(argv[first], "--latency") == 0)
+			latency = atoi(val);
+		else if (strcmp(argv[first], "--jitter") == 0)
+			jitter = atoi(val);
+		else if (strcmp(argv[first], "--loss") == 0)
+			loss = atof(val);
+		else if (strcmp(argv[first], "--seed") == 0)
+			seed = strtoul(val, NULL, 0);
+		else
+			break;
+		first += 2;
+	}
+	if ( (first + 1 < argc) || (channels < 1) || (channels > MAX_VOCODERS) || (latency < 0) || (jitter < 0) || (loss < 0) || (loss > 1) || (port < 1) || (port + channels > 65536) ) {
+		fprintf(stderr, "Usage: dmrvmsg --mock-ambeserver [--channels 1-%d] [--latency MS] [--jitter MS] [--loss FRACTION] [--seed N] [PORT]\n", MAX_VOCODERS);
+		return 1;
+	}
+	
+	sigset_t sigmask;
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGINT);
+	sigaddset(&sigmask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &sigmask, NULL);
+	int sigfd = signalfd(-1, &sigmask, 0);
+	int epfd = epoll_create1(0);
+	if ( (sigfd == -1) || (epfd == -1) ) {
+		perror("cannot create event descriptors");
+		return 1;
+	}
+	epoll_add(epfd, sigfd);
+	static mock_channel chans[MAX_VOCODERS];
+	for (int i = 0; i < channels; i++) {
+		mock_channel *c = &chans[i];
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		addr.sin_port = htons(port + i);
+		if ( ((c->sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0) || (bind(c->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) ) {
+			fprintf(stderr, "cannot listen on port %d: %s\n", port + i, strerror(errno));
+			return 1;
+		}
+		c->rand = (seed + i) * 2654435761U | 1U;
+		c->queue = malloc(MOCK_QUEUE * sizeof(mock_reply));
+		if (c->queue == NULL) {
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+		epoll_add(epfd, c->sock);
+	}
+	printf("Mock AMBEServer: %d channels on ports %d-%d, latency %d ms, jitter %d ms, loss %.1f%%\n", channels, port, port + channels - 1, latency, jitter, loss * 100);
+	
+	static udp_batch batch;
+	uint64_t decoded = 0, encoded = 0, control = 0, lost = 0;
+	while (1) {
+		int64_t nextt = -1;
+		for (int i = 0; i < channels; i++) {
+			if ( (chans[i].count > 0) && ((nextt == -1) || (chans[i].queue[chans[i].head].due < nextt)) )
+				nextt = chans[i].queue[chans[i].head].due;
+		}
+		int timeout = -1;
+		if (nextt != -1) {
+			int64_t wait = nextt - now_us();
+			timeout = (wait > 0) ? (wait + 999) / 1000 : 0;
+		}
+		struct epoll_event events[MAX_VOCODERS + 1];
+		int nev = epoll_wait(epfd, events, MAX_VOCODERS + 1, timeout);
+		if ( (nev == -1) && (errno != EINTR) ) {
+			perror("epoll_wait");
+			return 1;
+		}
+		for (int e = 0; e < nev; e++) {
+			if (events[e].data.fd == sigfd) {
+				printf("Mock AMBEServer: %llu frames decoded, %llu encoded, %llu control packets, %llu replies lost\n", (unsigned long long)decoded,
+						(unsigned long long)encoded, (unsigned long long)control, (unsigned long long)lost);
+				return 0;
+			}
+			mock_channel *c = NULL;
+			for (int i = 0; i < channels; i++) {
+				if (chans[i].sock == events[e].data.fd)
+					c = &chans[i];
+			}
+			int nmsg;
+			do {
+				nmsg = udp_recv_batch(c->sock, &batch);
+				for (int m = 0; m < nmsg; m++) {
+					uint8_t *pkt = batch.data[m];
+					int len = batch.msgs[m].msg_len;
+					if ( (len < 6) || (pkt[0] != 0x61) || ((pkt[1] << 8 | pkt[2]) != len - 4) )
+						continue;
+					if (c->count == MOCK_QUEUE) {
+						lost++;
+						continue;
+					}
+					mock_reply *r = &c->queue[(c->head + c->count) % MOCK_QUEUE];
+					if ( (pkt[3] == 0x01) && (len == 4+2+9) ) { //ambe to pcm
+						static const uint8_t h[] = {0x61, 0x01, 0x42, 0x02, 0x00, 160};
+						memcpy(r->data, h, sizeof(h));
+						mock_decode(c, &pkt[6], &r->data[6]);
+						r->len = 4+2+320;
+						decoded++;
+					} else if ( (pkt[3] == 0x02) && (len == 4+2+320) ) { //pcm to ambe
+						static const uint8_t h[] = {0x61, 0x00, 2+9, 0x01, 0x01, 72};
+						memcpy(r->data, h, sizeof(h));
+						mock_encode(&pkt[6], &r->data[6]);
+						r->len = 4+2+9;
+						encoded++;
+					} else if (pkt[3] == 0x00) { //control, the field is acknowledged. a rate setup starts a new stream
+						if (pkt[4] == 0x0A) {
+							c->gamma = 0;
+							c->phase = 0;
+						}
+						static const uint8_t h[] = {0x61, 0x00, 0x02, 0x00};
+						memcpy(r->data, h, sizeof(h));
+						r->data[4] = pkt[4];
+						r->data[5] = 0x00;
+						r->len = 4+2;
+						control++;
+					} else {
+						continue;
+					}
+					//decided at arrival, so the channel's random sequence does not depend on timing
+					bool drop = (mock_rand(c) < loss * 4294967295.0);
+					int delay = latency * 1000 + ((jitter > 0) ? mock_rand(c) % (jitter * 1000 + 1) : 0);
+					if (drop) {
+						lost++;
+						continue;
+					}
+					r->to = batch.addr[m];
+					r->due = now_us() + delay;
+					if (r->due < c->lastdue)
+						r->due = c->lastdue;
+					c->lastdue = r->due;
+					c->count++;
+				}
+			} while (nmsg == UDP_BATCH);
+		}
+		int64_t now = now_us();
+		for (int i = 0; i < channels; i++) {
+			mock_channel *c = &chans[i];
+			for (; (c->count > 0) && (c->queue[c->head].due <= now); c->head = (c->head + 1) % MOCK_QUEUE, c->count--) {
+				mock_reply *r = &c->queue[c->head];
+				sendto(c->sock, r->data, r->len, 0, (const struct sockaddr *)&r->to, sizeof(r->to));
+			}
+		}
+	}
+}
+
+#define BENCH_PACKETS 64
+#define BENCH_ROUNDS 200000
+
+void bench_report(const char *name, int64_t us, int n)
+{
+	printf("%-24s %7.1f ns/frame  %7.2f Mframes/s\n", name, (us * 1000.0) / n, (us > 0) ? (double)n / us : 0.0);
+}
+
+//dmrvmsg --bench: throughput of the dmrd codec, the fec and pcm paths every frame goes through.
+//packets sit at an odd offset, as they may in a receive batch
+int bench_main()
+{
+	static uint8_t store[BENCH_PACKETS * DMRD_LEN + 1];
+	uint8_t *pkts = store + 1;
+	uint8_t ambe[BENCH_PACKETS][27];
+	dmrd_builder b;
+	dmrd_builder_init(&b, 2680999, 2680001, 268099901, 1, 1, 0x12345678);
+	for (int i = 0; i < BENCH_PACKETS; i++) {
+		for (int k = 0; k < 27; k++)
+			ambe[i][k] = rand();
+		dmrd_build(&b, &pkts[i * DMRD_LEN], i, DMRMMDVM_FRAMETYPE_VOICE, i % 6);
+		dmrd_put_ambe(&pkts[i * DMRD_LEN + DMRD_DATA], ambe[i]);
+	}
+	int n = BENCH_PACKETS * BENCH_ROUNDS;
+	uint32_t sum = 0;
+	
+	int64_t t0 = now_us();
+	for (int r = 0; r < BENCH_ROUNDS; r++) {
+		for (int i = 0; i < BENCH_PACKETS; i++) {
+			dmrd_view d;
+			uint8_t frames[27];
+			dmrd_parse(&pkts[i * DMRD_LEN], DMRD_LEN, &d);
+			dmrd_get_ambe(d.data, frames);
+			sum += d.srcid + d.streamid + d.seq + frames[13];
+		}
+	}
+	bench_report("dmrd parse + ambe", now_us() - t0, n);
+	
+	t0 = now_us();
+	for (int r = 0; r < BENCH_ROUNDS; r++) {
+		for (int i = 0; i < BENCH_PACKETS; i++) {
+			uint8_t *pkt = &pkts[i * DMRD_LEN];
+			dmrd_build(&b, pkt, r + i, DMRMMDVM_FRAMETYPE_VOICE, i % 6);
+			dmrd_put_ambe(&pkt[DMRD_DATA], ambe[i]);
+			sum += pkt[33];
+		}
+	}
+	bench_report("dmrd build voice", now_us() - t0, n);
+	
+	t0 = now_us();
+	for (int r = 0; r < BENCH_ROUNDS / 64; r++) {
+		for (int i = 0; i < BENCH_PACKETS; i++) {
+			uint8_t *pkt = &pkts[i * DMRD_LEN];
+			dmrd_build(&b, pkt, r + i, DMRMMDVM_FRAMETYPE_DATASYNC, MMDVM_SLOTTYPE_HEADER);
+			generate_header(pkt);
+			sum += pkt[40];
+		}
+	}
+	bench_report("dmrd build header", now_us() - t0, n / 64);
+	
+	t0 = now_us();
+	for (int r = 0; r < BENCH_ROUNDS / 8; r++) {
+		for (int i = 0; i < BENCH_PACKETS; i++) {
+			for (int k = 0; k < 3; k++)
+				sum += ambe_errors(&ambe[i][k * 9]);
+		}
+	}
+	bench_report("ambe fec check", now_us() - t0, n / 8 * 3);
+	
+	static uint8_t pcm[BENCH_PACKETS][320 + 1];
+	for (int i = 0; i < BENCH_PACKETS; i++)
+		for (int k = 0; k < 320; k++)
+			pcm[i][k] = rand();
+	pcm_level level = {256, true, 256};
+	t0 = now_us();
+	for (int r = 0; r < BENCH_ROUNDS / 8; r++) {
+		for (int i = 0; i < BENCH_PACKETS; i++) {
+			pcm_level_apply(&level, &pcm[i][1], 160); //full scale noise, the agc keeps it at the target
+			sum += pcm[i][40];
+		}
+	}
+	bench_report("pcm swap + gain + agc", now_us() - t0, n / 8);
+	
+	return (sum == 0x5EED) ? 1 : 0; //keeps the loops from being optimized away
+}
+
+int main(int argc, char **argv)
+{
+	int 	udprx = -1; //descriptor of the event being handled, none until the first one
+	
+	//change stdout/stderr to line buffering
 	setvbuf(stdout, NULL, _IOLBF, 0);
 	setvbuf(stderr, NULL, _IOLBF, 0);
 	
+	golay23_init();
+	ulaw_init();
+	
+	if ( (argc > 1) && (strcmp(argv[1], "--decode") == 0) ) //before the chdir below, file names are relative to the caller
+		return decode_main(argc - 2, argv + 2);
+	if ( (argc > 1) && (strcmp(argv[1], "--replay") == 0) )
+		return replay_main(argc - 2, argv + 2);
+	if ( (argc > 1) && (strcmp(argv[1], "--mock-ambeserver") == 0) )
+		return mock_main(argc - 2, argv + 2);
+	if ( (argc > 1) && (strcmp(argv[1], "--bench") == 0) )
+		return bench_main();
+	
 	//change working directory to the executable directory
 	char exepath[4096] = {0};
 	if (readlink("/proc/self/exe", exepath, sizeof(exepath)-1) == -1) {
@@ -1009,25 +4373,34 @@ int main(int argc, char **argv)
 	//seed random generator
 	srand(time(NULL));
 	
+	//options come first, the positional arguments are shifted down over them
+	int opt;
+	char *capture_path = NULL;
+	while (argc > 1) {
+		if ( (argc > 2) && (strcmp(argv[1], "--capture") == 0) ) {
+			capture_path = argv[2];
+			opt = 2;
+		} else if ((opt = pcm_option(argc, argv, 1)) == 0) {
+			break;
+		}
+		if (opt == -1)
+			return 1;
+		argc -= opt;
+		argv += opt;
+	}
+	
 	if( (argc != 5) && (argc != 6) ){
-		fprintf(stderr, "Usage: dmrvmsg [CALLSIGN] [DMRID] [DMRHostIP:PORT:TG:PW] [AMBEServerIP:PORT] [SavePath]\n");
+		fprintf(stderr, "Usage: dmrvmsg [--gain DB] [--agc] [--capture FILE] [CALLSIGN] [DMRID] [DMRHostIP:PORT:TG:PW[,DMRHostIP:PORT:TG:PW...]] [AMBEServerIP:PORT[,AMBEServerIP:PORT...]] [SavePath]\n");
 		return 0;
 	}
 	else{
 		memset(callsign, ' ', 10);
 		memcpy(callsign, argv[1], strlen(argv[1]));
 		dmrid = atoi(argv[2]);
-		host1_url = strtok(argv[3], ":");
-		host1_port = atoi(strtok(NULL, ":"));
-		host1_tg = atoi(strtok(NULL, ":"));
-		host1_pw = strtok(NULL, ":");
-		host2_url = strtok(argv[4], ":");
-		host2_port = atoi(strtok(NULL, ":"));
-		printf("DMR: %s:%d\n", host1_url, host1_port);
-		printf("AMBEServer: %s:%d\n", host2_url, host2_port);
+		if (!masters_parse(argv[3]) || !vocoders_parse(argv[4]))
+			return 0;
 	}
 	
-	char recpath[4096] = {0};
 	if (argc > 5)
 		if (strlen(argv[5]) < sizeof(recpath)-1)
 			strcpy(recpath, argv[5]);
@@ -1036,50 +4409,68 @@ int main(int argc, char **argv)
 	if (recpath[strlen(recpath)-1] != '/')
 		recpath[strlen(recpath)] = '/';
 	printf("Save recordings to: %s\n", recpath);
+	if ( (capture_path != NULL) && !capture_open(capture_path) )
+		return 0;
 	
-	signal(SIGINT, process_signal); 						//Handle CTRL-C gracefully
-	signal(SIGALRM, process_signal); 						//Ping timer
+	//signals are read from a signalfd in the main loop, keep them away from the loader threads too
+	sigset_t sigmask;
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGINT); 							//Handle CTRL-C gracefully
+	sigaddset(&sigmask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &sigmask, NULL);
 	
-	if ((udp1 = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-		perror("cannot create socket");
+	if (!masters_open() || !vocoders_open())
 		return 0;
-	}
-	
-	if ((udp2 = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-		perror("cannot create socket");
+
+	if (!recorder_start()) {
+		fprintf(stderr, "failed to start recorder thread\n");
 		return 0;
 	}
 	
-	maxudp = max(udp1, udp2) + 1;
-	memset((char *)&host1, 0, sizeof(host1));
-	host1.sin_family = AF_INET;
-	host1.sin_port = htons(host1_port);
-	memset((char *)&host2, 0, sizeof(host2));
-	host2.sin_family = AF_INET;
-	host2.sin_port = htons(host2_port);
-
-	hp = gethostbyname(host1_url);
-	if (!hp) {
-		fprintf(stderr, "could not resolve %s\n", host1_url);
+	dmrids = dmrids_load(DMRIDS_FILE);
+	if (dmrids != NULL)
+		printf("DMRIds: loaded %d ids in %d ms\n", dmrids->count, dmrids_loadms);
+	else
+		fprintf(stderr, "failed to load %s\n", DMRIDS_FILE);
+	time_t dmrids_checkt = time(NULL) + DMRIDS_CHECK_INTERVAL;
+	txcache_load();
+	
+	int sigfd = signalfd(-1, &sigmask, 0);
+	int pingfd = timerfd_create(CLOCK_MONOTONIC, 0); //ping timer
+	int hangfd = timerfd_create(CLOCK_MONOTONIC, 0); //next rx hang or tx start deadline
+	int epfd = epoll_create1(0);
+	txdonefd = eventfd(0, EFD_NONBLOCK);
+	if ( (sigfd == -1) || (pingfd == -1) || (hangfd == -1) || (epfd == -1) || (txdonefd == -1) ) {
+		perror("cannot create event descriptors");
 		return 0;
 	}
-	memcpy((void *)&host1.sin_addr, hp->h_addr_list[0], hp->h_length);
-
-	hp = gethostbyname(host2_url);
-	if (!hp) {
-		fprintf(stderr, "could not resolve %s\n", host2_url);
+	
+	//masters are received on the net thread and the prompt is played on the tx thread, the main loop handles calls and vocoders
+	pthread_t th;
+	if ( !spsc_init(&net_ring, "net", NET_QUEUE_SIZE, sizeof(net_packet)) || !spsc_init(&tx_ring, "tx", TX_QUEUE_SIZE, sizeof(tx_request))
+	  || (pthread_create(&th, NULL, net_thread, NULL) != 0) || (pthread_detach(th) != 0)
+	  || (pthread_create(&th, NULL, tx_thread, NULL) != 0) || (pthread_detach(th) != 0) ) {
+		fprintf(stderr, "failed to start pipeline threads\n");
 		return 0;
 	}
-	memcpy((void *)&host2.sin_addr, hp->h_addr_list[0], hp->h_length);
-
-	int host1_connect_status = DISCONNECTED;
-	
-	alarm(5);
+	metrics_start();
+	stage_pin("main", CPU_MAIN);
+	epoll_add(epfd, net_ring.efd);
+	for (int i = 0; i < vocoder_count; i++)
+		epoll_add(epfd, vocoders[i].sock);
+	epoll_add(epfd, sigfd);
+	epoll_add(epfd, pingfd);
+	epoll_add(epfd, txdonefd);
+	epoll_add(epfd, hangfd);
+	timer_arm(pingfd, now_ms() + PING_INTERVAL, PING_INTERVAL);
 	
 	while (1) {
-		if(host1_connect_status == DISCONNECTED){
-			host1_connect_status = CONNECTING;
-			pong_time1 = time(NULL);
+		for (int i = 0; i < master_count; i++) {
+			master *m = &masters[i];
+			if(m->connect_status != DISCONNECTED)
+				continue;
+			master_set_status(m, CONNECTING);
+			m->pong_time = time(NULL);
 			buf[0] = 'R';
 			buf[1] = 'P';
 			buf[2] = 'T';
@@ -1088,433 +4479,164 @@ int main(int argc, char **argv)
 			buf[5] = (dmrid >> 16) & 0xff;
 			buf[6] = (dmrid >> 8) & 0xff;
 			buf[7] = (dmrid >> 0) & 0xff;
-			sendto(udp1, buf, 8, 0, (const struct sockaddr *)&host1, sizeof(host1));
-			fprintf(stderr, "Connecting to %s...\n", host1_url);
+			sendto(m->sock, buf, 8, 0, (const struct sockaddr *)&m->addr, sizeof(m->addr));
+			fprintf(stderr, "Connecting to %s:%d...\n", m->url, m->port);
 #ifdef DEBUG
 			fprintf(stderr, "SEND DMR: ");
-			for(int i = 0; i < 8; ++i)
-				fprintf(stderr, "%02x ", buf[i]);
+			for(int k = 0; k < 8; ++k)
+				fprintf(stderr, "%02x ", buf[k]);
 			fprintf(stderr, "\n");
 #endif
 		}
-		FD_ZERO(&udpset);
-		FD_SET(udp1, &udpset);
-		FD_SET(udp2, &udpset);
-		tv.tv_sec = 0;
-		tv.tv_usec = 5*1000;
-		r = select(maxudp, &udpset, NULL, NULL, &tv);
-		//fprintf(stderr, "Select returned r == %d\n", r);
-		rxlen = 0;
-		if(r > 0){
-			if(FD_ISSET(udp1, &udpset)) {
-				rxlen = recvfrom(udp1, buf, BUFSIZE, 0, (struct sockaddr *)&rx, &l);
-				udprx = udp1;
-			}
-			else if(FD_ISSET(udp2, &udpset)) {
-				rxlen = recvfrom(udp2, buf, BUFSIZE, 0, (struct sockaddr *)&rx, &l);
-				udprx = udp2;
-			}
+		struct epoll_event events[16];
+		int nev = epoll_wait(epfd, events, 16, -1);
+		if ( (nev == -1) && (errno != EINTR) ) {
+			perror("epoll_wait");
+			return 0;
 		}
-#ifdef DEBUG
-		if(rxlen >= 11){
-			if ((udprx == udp1) && (rx.sin_addr.s_addr == host1.sin_addr.s_addr)){
-				fprintf(stderr, "RECV DMR: ");
+		for (int e = 0; e < nev; e++) {
+			udprx = events[e].data.fd;
+			if (udprx == sigfd) {
+				struct signalfd_siginfo si;
+				if (read(sigfd, &si, sizeof(si)) == sizeof(si)) {
+					//finalize the recordings in progress before going away
+					for (int i = 0; i < MAX_RX_SESSIONS; i++) {
+						if (rx_sessions[i].active)
+							rx_session_close(&rx_sessions[i]);
+					}
+					recorder_drain();
+					if (capture_file != NULL)
+						capture_flush();
+					process_signal(si.ssi_signo);
+				}
+				continue;
 			}
-			else if((udprx == udp2) && (rx.sin_addr.s_addr == host2.sin_addr.s_addr)){
-				fprintf(stderr, "RECV AMBE: ");
+			if (udprx == pingfd) {
+				timer_expirations(pingfd);
+				for (int i = 0; i < master_count; i++)
+					send_ping(&masters[i]);
+				for (int i = 0; i < vocoder_count; i++) {
+					if (vocoders[i].down)
+						vocoder_setup(&vocoders[i]); //probe, any reply brings it back
+				}
+				txcache_check();
+				if (capture_file != NULL)
+					capture_flush();
+				if (time(NULL) >= dmrids_checkt) {
+					dmrids_check();
+					dmrids_checkt = time(NULL) + DMRIDS_CHECK_INTERVAL;
+				}
+				for (int i = 0; i < master_count; i++) {
+					if (time(NULL)-masters[i].pong_time > TIMEOUT) {
+						master_set_status(&masters[i], DISCONNECTED);
+						fprintf(stderr, "DMR connection to %s:%d timed out, retrying connection...\n", masters[i].url, masters[i].port);
+					}
+				}
+				continue;
 			}
-			for(int i = 0; i < rxlen; ++i){
-				fprintf(stderr, "%02x ", buf[i]);
+			if (udprx == txdonefd) {
+				timer_expirations(txdonefd); //reads the eventfd counter the same way
+				txactive = false;
+				continue;
 			}
-			fprintf(stderr, "\n");
-		}
-#endif
-    if( rxlen && (udprx == udp1) && (rx.sin_addr.s_addr == host1.sin_addr.s_addr) ){
-      if((host1_connect_status != CONNECTED_RW) && (memcmp(buf, "RPTACK", 6U) == 0)){
-        host1_connect_status = process_connect(host1_connect_status, buf);
-      }
-      else if( (host1_connect_status == CONNECTED_RW) && (memcmp(buf, "MSTPONG", 7U) == 0) ){
-        pong_time1 = time(NULL);
-      }
-      else if( (host1_connect_status == CONNECTED_RW) && (rxlen == 55) && (memcmp(buf, "DMRD", 4U) == 0) ){
-        rx_srcid = ((buf[5] << 16) & 0xff0000) | ((buf[6] << 8) & 0xff00) | (buf[7] & 0xff);
-        
-        uint8_t Slot = (buf[15] & 0x80) >> 7; //0: slot1, 1: slot2
-        uint8_t CallType = (buf[15] & 0x40) >> 6; //0: group call, 1: private call
-        uint8_t FrameType = (buf[15] & 0x30) >> 4;
-        rx_calltype = CallType;
-
-        if ( (FrameType == DMRMMDVM_FRAMETYPE_DATASYNC) /*&& (CallType == 1)*/ ) {
-          if ((buf[15] & 0x0F) == MMDVM_SLOTTYPE_HEADER) {
-            //ignore duplicate header packets with the same stream id
-            if ( rx_streamid == *(uint32_t *)(&buf[16]) )
-              continue;
-            rx_streamid = *(uint32_t *)(&buf[16]);
-            
-            char rx_callsign[20] = {0};
-            FILE *idsfile = fopen("DMRIds.dat", "r");
-            if (idsfile) {
-              char tmp_line[200];
-              int tmp_id;
-              char tmp_callsign[20];
-              while (fgets(tmp_line, sizeof(tmp_line), idsfile) != NULL) {
-                sscanf(tmp_line, "%u %19s", &tmp_id, tmp_callsign);
-                if (tmp_id == rx_srcid) {
-                  strcpy(rx_callsign, tmp_callsign);
-                  break;
-                }
-              }
-              fclose(idsfile);
-            }
-            
-            /*if (rx_ambefile != NULL) fclose(rx_ambefile);
-            rx_ambefile = fopen("rx.ambe" , "wb");
-            static const uint8_t header[] = {'A','M','B','E'};
-            if (rx_ambefile != NULL)
-              fwrite(header, 1, sizeof(header), rx_ambefile);*/
-
-            if (rx_wavefile != NULL) {
-              rewind(rx_wavefile);
-              rx_wavheader.data_bytes = rx_ambefcnt * 320;
-              rx_wavheader.wav_size = rx_wavheader.data_bytes + sizeof(rx_wavheader) - 8;
-              fwrite(&rx_wavheader, 1, sizeof(rx_wavheader), rx_wavefile);
-              fclose(rx_wavefile);
-              rx_wavefile = NULL;
-            }
-
-            memcpy(rx_wavheader.riff_header, "RIFF", 4);
-            memcpy(rx_wavheader.wave_header, "WAVE", 4);
-            memcpy(rx_wavheader.fmt_header, "fmt ", 4);
-            rx_wavheader.fmt_chunk_size = 16;
-            rx_wavheader.audio_format = 1;
-            memcpy(rx_wavheader.data_header, "data", 4);
-            rx_wavheader.num_channels = 1;
-            rx_wavheader.sample_rate = 8000;
-            rx_wavheader.bit_depth = 16;
-            rx_wavheader.sample_alignment = (rx_wavheader.bit_depth / 8) * rx_wavheader.num_channels;
-            rx_wavheader.byte_rate = rx_wavheader.sample_rate * rx_wavheader.sample_alignment;
-            rx_wavheader.data_bytes = 0; //filled later
-            rx_wavheader.wav_size = rx_wavheader.data_bytes + sizeof(rx_wavheader) - 8;
-
-            char filename[4096];
-            struct timeval tv;
-            gettimeofday(&tv, NULL);
-            struct tm *ptm = gmtime(&tv.tv_sec);
-            sprintf(filename, "%s%04d-%02d-%02d_%02d.%02d.%02d.%03d_%d_%s.wav", recpath, ptm->tm_year+1900, ptm->tm_mon+1, ptm->tm_mday,
-                      ptm->tm_hour, ptm->tm_min, ptm->tm_sec, tv.tv_usec / 1000,  rx_srcid, rx_callsign);
-            rx_wavefile = fopen(filename , "wb");
-            if (rx_wavefile != NULL) {
-              fwrite(&rx_wavheader, 1, sizeof(rx_wavheader), rx_wavefile);
-            } else {
-              fprintf(stderr, "failed to open wav file\n");
-            }
-
-            static const uint8_t ambe_gain[] = {0x61,0x00,0x03,0x00,0x4B,AMBE_ENCODE_GAIN,AMBE_DECODE_GAIN};
-            sendto(udp2, ambe_gain, sizeof(ambe_gain), 0, (const struct sockaddr *)&host2, sizeof(host2));
-
-            static const uint8_t ambe_ratep[] = {0x61,0x00,0x0D,0x00,0x0A,0x04,0x31,0x07,0x54,0x24,0x00,0x00,0x00,0x00,0x00,0x6F,0x48};
-            sendto(udp2, ambe_ratep, sizeof(ambe_ratep), 0, (const struct sockaddr *)&host2, sizeof(host2));
-            
-            printf("*** RX START (srcid: %d, callsign: %s) ***\n", rx_srcid, rx_callsign);
-            rx_ambefcnt = 0;
-            rx_endt = time(NULL)+2; //allow rx end without terminator, after extra timeout
-          }
-          else if ((buf[15] & 0x0F) == MMDVM_SLOTTYPE_TERMINATOR) {
-            rx_streamid = -1;
-            rx_endt = time(NULL)+1;
-          }
-        }
-
-        else if ( ((FrameType == DMRMMDVM_FRAMETYPE_VOICE) || (FrameType == DMRMMDVM_FRAMETYPE_VOICESYNC)) /*&& (CallType == 1)*/ ) {
-          uint8_t rx_ambefr[3][9];
-          memcpy(&rx_ambefr[0][0], &buf[20], 9);
-          memcpy(&rx_ambefr[1][0], &buf[29], 4);
-          rx_ambefr[1][4] = (buf[33] & 0xF0) | (buf[39] & 0x0F);
-          memcpy(&rx_ambefr[1][5], &buf[40], 4);
-          memcpy(&rx_ambefr[2][0], &buf[44], 9);
-          
-          if (rx_ambefile != NULL) {
-            fwrite(rx_ambefr[0], 1, 9, rx_ambefile);
-            fwrite(rx_ambefr[1], 1, 9, rx_ambefile);
-            fwrite(rx_ambefr[2], 1, 9, rx_ambefile);
-          }
-
-          //send ambe frames to ambeserver
-          uint8_t ambebuf[4+2+9] = {0x61, 0x00, 2+9, 0x01,  0x01, 72};
-          for (int i=0; i < 3; i++) {
-            memcpy(&ambebuf[6], rx_ambefr[i], 9);
-            sendto(udp2, ambebuf, sizeof(ambebuf), 0, (const struct sockaddr *)&host2, sizeof(host2));
-          }
-          
-          rx_endt = time(NULL)+2; //allow rx end without terminator, after extra timeout
-        }
-        
-      }
-    }
-
-    else if( rxlen && (udprx == udp2) && (rx.sin_addr.s_addr == host2.sin_addr.s_addr) ){ //from ambeserver
-      if ((rxlen == 4+2+320) && (buf[0] == 0x61) && (buf[3] == 0x02)) {
-        if (rx_wavefile == NULL) { //if rx file not open, discard packet
+			if (udprx == net_ring.efd) {
+				spsc_ack(&net_ring);
+				for (net_packet *p = spsc_peek(&net_ring); p != NULL; p = spsc_peek(&net_ring)) {
 #ifdef DEBUG
-          fprintf(stderr, "*** discarding pcm packet from ambeserver ***\n");
+					if (p->len >= 11) {
+						fprintf(stderr, "RECV DMR: ");
+						for(int i = 0; i < p->len; ++i)
+							fprintf(stderr, "%02x ", p->data[i]);
+						fprintf(stderr, "\n");
+					}
 #endif
-          continue;
-        }
-        for (int i=0; i < 160; i++) //swap byte order for all samples, AMBE3000 uses MSB first
-          ((unsigned short *)(&buf[6]))[i] = (((unsigned short *)(&buf[6]))[i] >> 8) | (((unsigned short *)(&buf[6]))[i] << 8);
-        fwrite(&buf[6], 1, 320, rx_wavefile);
-        rx_ambefcnt++;
-      }
-      else if ((rxlen == 4+2+9) && (buf[0] == 0x61) && (buf[3] == 0x01)) {
-        if (tx_wavefile == NULL) { //if tx terminated, discard late packet from ambeserver, not good to tx them after terminator
-#ifdef DEBUG
-          fprintf(stderr, "*** discarding ambe packet from ambeserver ***\n");
-#endif
-          continue;
-        }
-        memcpy(tx_ambefr[tx_ambefcnt % 3], &buf[6], 9);
-        if ( (tx_ambefcnt % 3) == 2 ) {
-          memset(buf, 0, 55);
-          memcpy(buf, "DMRD", 4);
-          buf[4] = ((tx_ambefcnt / 3) + 1) % 256;
-          tx_srcid = ((dmrid>99999999)?dmrid/100:dmrid);
-          buf[5] = (tx_srcid >> 16) & 0xff;
-          buf[6] = (tx_srcid >> 8) & 0xff;
-          buf[7] = (tx_srcid >> 0) & 0xff;
-          buf[8] = (tx_tgid >> 16) & 0xff;
-          buf[9] = (tx_tgid >> 8) & 0xff;
-          buf[10] = (tx_tgid >> 0) & 0xff;
-          buf[11] = (dmrid >> 24) & 0xff;
-          buf[12] = (dmrid >> 16) & 0xff;
-          buf[13] = (dmrid >> 8) & 0xff;
-          buf[14] = (dmrid >> 0) & 0xff;
-
-          buf[15] = 0x80 | (((tx_ambefcnt / 3) % 6) & 0x0F);
-          if (tx_calltype == 1) { buf[15] |= 0x40; };
-          if ((buf[15] & 0x0F) == 0) {
-            buf[15] |= (DMRMMDVM_FRAMETYPE_VOICESYNC << 4);
-          } else {
-            buf[15] |= (DMRMMDVM_FRAMETYPE_VOICE << 4);
-          }
-          
-          *(uint32_t *)(&buf[16]) = tx_streamid;
-
-          memcpy(&buf[20], tx_ambefr[0], 9);
-          memcpy(&buf[29], tx_ambefr[1], 4);
-          buf[33] = tx_ambefr[1][4] & 0xF0;
-          buf[39] = tx_ambefr[1][4] & 0x0F;
-          memcpy(&buf[40], &tx_ambefr[1][5], 4);
-          memcpy(&buf[44], tx_ambefr[2], 9);
-
-          if ((buf[15] & 0x0F) == 0) {
-            static const uint8_t sync_ms_voice[] = { 0x07,0xF7,0xD5,0xDD,0x57,0xDF,0xD0 };
-            buf[33] = (buf[33] & 0xF0) | (sync_ms_voice[0] & 0x0F);
-            memcpy(&buf[34], &sync_ms_voice[1], 5);
-            buf[39] = (sync_ms_voice[6] & 0xF0) | (buf[39] & 0x0F);
-            encode_embedded_data();
-          } else {
-            uint8_t lcss = get_embedded_data(buf+20, buf[15] & 0x0F);
-            get_emb_data(buf+20, lcss);
-          }
-
-          sendto(udp1, buf, 55, 0, (const struct sockaddr *)&host1, sizeof(host1));
+					if ( (p->len > 0) && (p->from == p->host->addr.sin_addr.s_addr) )
+						process_dmr_packet(p->host, p->data, p->len);
+					spsc_pop(&net_ring);
+				}
+				continue;
+			}
+			if (udprx == hangfd) {
+				timer_expirations(hangfd);
+				continue;
+			}
+			//drain the socket, a few batches at a time
+			vocoder *rxvoc = vocoder_find(udprx);
+			for (int batch = 0; (batch < UDP_RX_BATCHES) && (rxvoc != NULL); batch++) {
+				int nmsg = rxvoc->backend->recv(rxvoc, &rxbatch);
+				for (int m = 0; m < nmsg; m++) {
+					uint8_t *pkt = rxbatch.data[m];
+					int rxlen = rxbatch.msgs[m].msg_len;
+					struct sockaddr_in *rx = &rxbatch.addr[m];
 #ifdef DEBUG
-          fprintf(stderr, "SEND DMR: ");
-          for(int i = 0; i < 55; ++i)
-            fprintf(stderr, "%02x ", buf[i]);
-          fprintf(stderr, "\n");
+					if(rxlen >= 11){
+						if((rxvoc != NULL) && (rx->sin_addr.s_addr == rxvoc->addr.sin_addr.s_addr)){
+							fprintf(stderr, "RECV AMBE: ");
+						}
+						for(int i = 0; i < rxlen; ++i){
+							fprintf(stderr, "%02x ", pkt[i]);
+						}
+						fprintf(stderr, "\n");
+					}
 #endif
-        }
-        tx_ambefcnt++;
+					if( (rxlen > 0) && (rxvoc != NULL) && (rx->sin_addr.s_addr == rxvoc->addr.sin_addr.s_addr) ) { //from ambeserver
+						if (capture_file != NULL)
+							capture_write(CAPTURE_VOCODER + (rxvoc - vocoders), pkt, rxlen);
+						process_vocoder_packet(rxvoc, pkt, rxlen);
+					}
+				}
+				if (nmsg < UDP_BATCH)
+					break;
+			}
+		}
+
+    int64_t now = now_ms();
+    vocoder_check(now);
+    rx_end_check(now);
+      
+    txcache_run();
+    for (int i = 0; i < master_count; i++) {
+      if ( masters[i].txpending && (tx_cache.pcm == NULL) ) {
+        fprintf(stderr, "no %s to play back, tx cancelled\n", TXMSG_FILE);
+        masters[i].txpending = false;
       }
     }
-
-    //if ((host1_connect_status == CONNECTED_RW) && !rx_endt) { rx_endt=time(NULL)+5; } //dbg
-
-    if (rx_endt && (time(NULL) > rx_endt)) { //rx end
-        if (rx_ambefile != NULL) {
-          fclose(rx_ambefile);
-          rx_ambefile = NULL;
-        }
-        if (rx_wavefile != NULL) {
-          rewind(rx_wavefile);
-          rx_wavheader.data_bytes = rx_ambefcnt * 320;
-          rx_wavheader.wav_size = rx_wavheader.data_bytes + sizeof(rx_wavheader) - 8;
-          fwrite(&rx_wavheader, 1, sizeof(rx_wavheader), rx_wavefile);
-          fclose(rx_wavefile);
-          rx_wavefile = NULL;
-          printf("*** RX END (ambeframes: %d) ***\n", rx_ambefcnt);
-          rx_streamid = -1;
-          
-          if (txpending) { //if there is a pending tx, ignore current rx
-            rx_endt = time(NULL)+1; //wait a bit more before starting the pending tx
-            continue;
-          }
-          if (rx_ambefcnt < 50) { //if we got less than 1 sec. of audio
-            rx_endt = 0; //cancel processing this short rx
-            continue;
-          }
-          if (tx_wavefile != NULL) {
-            fclose(tx_wavefile); //ensure tx wav file is closed before script tries to write on it
-            tx_wavefile = NULL;
-          }
-          //char cmdstr[50];
-          //sprintf(cmdstr, "python3 -u dmrbot.py %d", rx_srcid);
-          //if (system(cmdstr) != 0) {
-            //rx_endt = 0; //cancel tx if script fails
-            //continue;
-            //fprintf(stderr, "dmrbot.py returned error, tx unavailable.wav file...\n");
-            //system("cat unavailable.wav > tx.wav");
-          //}
-          pong_time1 = time(NULL); //prevent timeout due to time spent on system() call
-          rx_endt = time(NULL)+1; //wait a bit more before starting tx, allow rx to check if someone else tx
-          if (rx_calltype == 1) { //private call
-            tx_tgid = rx_srcid;
-            tx_calltype = 1;
-          } else { //group call
-            tx_tgid = host1_tg;
-            tx_calltype = 0;
-          }
-          txpending = true;
-          continue;
-        }
-          
-        //tx playback
-        if ( txpending && (tx_wavefile == NULL) ) {
-          printf("*** TX START ***\n");
-          txpending = false;
-          tx_ambefcnt = 0;
-          trgus = 0;
-          tx_streamid = (rand() % 0xffffffff) + 1;
-          tx_wavefile = fopen("txmsg.wav" , "rb");
-          if (tx_wavefile == NULL) {
-            fprintf(stderr, "failed to open tx.wav file\n");
-            rx_endt = 0; //cancel tx
-            continue;
-          }
-          
-          wav_header tx_wavheader;
-          if ( fread(&tx_wavheader, 1, sizeof(tx_wavheader), tx_wavefile) != sizeof(tx_wavheader) ) {
-            fprintf(stderr, "invalid wav file\n");
-            fclose(tx_wavefile);
-            tx_wavefile = NULL;
-            rx_endt = 0; //cancel tx
-            continue;
-          }
-          if (memcmp(tx_wavheader.data_header, "LIST", 4U) == 0) { //skip LIST chunk
-            fseek(tx_wavefile, tx_wavheader.data_bytes, SEEK_CUR);
-            fread(tx_wavheader.data_header, 1, sizeof(tx_wavheader.data_header), tx_wavefile);
-            fread(&tx_wavheader.data_bytes, 1, sizeof(tx_wavheader.data_bytes), tx_wavefile);
-          }
-          if ( (memcmp(tx_wavheader.riff_header, "RIFF", 4U) != 0)
-            || (memcmp(tx_wavheader.wave_header, "WAVE", 4U) != 0)
-            || (memcmp(tx_wavheader.fmt_header,  "fmt ", 4U) != 0)
-            || (memcmp(tx_wavheader.data_header, "data", 4U) != 0) ) {
-            fprintf(stderr, "invalid wav file\n");
-            fclose(tx_wavefile);
-            tx_wavefile = NULL;
-            rx_endt = 0; //cancel tx
-            continue;
-          }
-          if ( (tx_wavheader.sample_rate != 8000) || (tx_wavheader.bit_depth != 16) || (tx_wavheader.num_channels != 1) ) {
-            fprintf(stderr, "wav file must be 8000Hz 16-bit mono\n");
-            fclose(tx_wavefile);
-            tx_wavefile = NULL;
-            rx_endt = 0; //cancel tx
-            continue;
-          }
-          
-          //send header packet
-          memset(buf, 0, 55);
-          memcpy(buf, "DMRD", 4);
-          buf[4] = 0;
-          tx_srcid = ((dmrid>99999999)?dmrid/100:dmrid);
-          buf[5] = (tx_srcid >> 16) & 0xff;
-          buf[6] = (tx_srcid >> 8) & 0xff;
-          buf[7] = (tx_srcid >> 0) & 0xff;
-          buf[8] = (tx_tgid >> 16) & 0xff;
-          buf[9] = (tx_tgid >> 8) & 0xff;
-          buf[10] = (tx_tgid >> 0) & 0xff;
-          buf[11] = (dmrid >> 24) & 0xff;
-          buf[12] = (dmrid >> 16) & 0xff;
-          buf[13] = (dmrid >> 8) & 0xff;
-          buf[14] = (dmrid >> 0) & 0xff;
-          buf[15] = 0x80 | (DMRMMDVM_FRAMETYPE_DATASYNC << 4) | MMDVM_SLOTTYPE_HEADER;
-          if (tx_calltype == 1) { buf[15] |= 0x40; };
-          *(uint32_t *)(&buf[16]) = tx_streamid;
-          generate_header();
-          sendto(udp1, buf, 55, 0, (const struct sockaddr *)&host1, sizeof(host1));
-#ifdef DEBUG
-          fprintf(stderr, "SEND DMR: ");
-          for(int i = 0; i < 55; ++i)
-            fprintf(stderr, "%02x ", buf[i]);
-          fprintf(stderr, "\n");
-#endif
-            
-          static const uint8_t ambe_gain[] = {0x61,0x00,0x03,0x00,0x4B,AMBE_ENCODE_GAIN,AMBE_DECODE_GAIN};
-          sendto(udp2, ambe_gain, sizeof(ambe_gain), 0, (const struct sockaddr *)&host2, sizeof(host2));
-
-          static const uint8_t ambe_ratep[] = {0x61,0x00,0x0D,0x00,0x0A,0x04,0x31,0x07,0x54,0x24,0x00,0x00,0x00,0x00,0x00,0x6F,0x48};
-          sendto(udp2, ambe_ratep, sizeof(ambe_ratep), 0, (const struct sockaddr *)&host2, sizeof(host2));
-        }
-        
-        if (tx_wavefile != NULL) {
-          //ensure the code below only runs once every 20ms
-          struct timespec nanos;
-          clock_gettime(CLOCK_MONOTONIC, &nanos);
-          int64_t nowus = (int64_t)nanos.tv_sec * 1000000 + nanos.tv_nsec / 1000;
-          if (abs(trgus - nowus) > 1000000)
-            trgus = nowus;
-          if (nowus < trgus)
-            continue;
-          trgus += 20000;
-          //printf("%lld\n", nowus/1000);
-          
-          uint8_t ambebuf[4+2+320] = {0x61, 0x01, 0x42, 0x02,  0x00, 160};
-          if ( fread(&ambebuf[6], 1, 320, tx_wavefile) == 320 ) {
-            for (int i=0; i < 160; i++) //swap byte order for all samples, AMBE3000 uses MSB first
-              ((unsigned short *)(&ambebuf[6]))[i] = (((unsigned short *)(&ambebuf[6]))[i] >> 8) | (((unsigned short *)(&ambebuf[6]))[i] << 8);
-            sendto(udp2, ambebuf, sizeof(ambebuf), 0, (const struct sockaddr *)&host2, sizeof(host2));
-          } else {
-            fclose(tx_wavefile);
-            tx_wavefile = NULL;
-            rx_endt = 0;
-            printf("*** TX END ***\n");
-
-            //send terminator packet
-            memset(buf, 0, 55);
-            memcpy(buf, "DMRD", 4);
-            buf[4] = ((tx_ambefcnt / 3) + 1) % 256;
-            tx_srcid = ((dmrid>99999999)?dmrid/100:dmrid);
-            buf[5] = (tx_srcid >> 16) & 0xff;
-            buf[6] = (tx_srcid >> 8) & 0xff;
-            buf[7] = (tx_srcid >> 0) & 0xff;
-            buf[8] = (tx_tgid >> 16) & 0xff;
-            buf[9] = (tx_tgid >> 8) & 0xff;
-            buf[10] = (tx_tgid >> 0) & 0xff;
-            buf[11] = (dmrid >> 24) & 0xff;
-            buf[12] = (dmrid >> 16) & 0xff;
-            buf[13] = (dmrid >> 8) & 0xff;
-            buf[14] = (dmrid >> 0) & 0xff;
-            buf[15] = 0x80 | (DMRMMDVM_FRAMETYPE_DATASYNC << 4) | MMDVM_SLOTTYPE_TERMINATOR;
-            if (tx_calltype == 1) { buf[15] |= 0x40; };
-            *(uint32_t *)(&buf[16]) = tx_streamid;
-            generate_header();
-            sendto(udp1, buf, 55, 0, (const struct sockaddr *)&host1, sizeof(host1));
-#ifdef DEBUG
-            fprintf(stderr, "SEND DMR: ");
-            for(int i = 0; i < 55; ++i)
-              fprintf(stderr, "%02x ", buf[i]);
-            fprintf(stderr, "\n");
-#endif
-          }
-        }
-        
+    
+    //tx playback from the cached prompt, once the slot we reply on is quiet. one tx at a time, the longest waiting master first
+    master *txnext = NULL;
+    for (int i = 0; (i < master_count) && !txactive && tx_cache.ready; i++) {
+      master *m = &masters[i];
+      if ( m->txpending && (now >= m->tx_startt) && !rx_slot_busy(m, m->tx_slot) && ((txnext == NULL) || (m->tx_startt < txnext->tx_startt)) )
+        txnext = m;
+    }
+    tx_request *req;
+    if ( (txnext != NULL) && ((req = spsc_slot(&tx_ring, 0)) != NULL) ) {
+      txnext->txpending = false;
+      tx_master = txnext;
+      txactive = true;
+      req->host = txnext;
+      req->tgid = txnext->tx_tgid;
+      req->calltype = txnext->tx_calltype;
+      req->slot = txnext->tx_slot;
+      req->streamid = (rand() % 0xffffffff) + 1;
+      spsc_push(&tx_ring);
     }
     
-    if (time(NULL)-pong_time1 > TIMEOUT) {
-      host1_connect_status = DISCONNECTED;
-      fprintf(stderr, "DMR connection timed out, retrying connection...\n");
+    backfill_run();
+    vocoder_flush();
+    recorder_kick();
+    spsc_kick(&tx_ring);
+    
+    //sleep until the next rx hang timeout or pending tx start
+    int64_t nextt = 0;
+    for (int i = 0; i < MAX_RX_SESSIONS; i++) {
+      if ( rx_sessions[i].active && ((nextt == 0) || (rx_sessions[i].endt < nextt)) )
+        nextt = rx_sessions[i].endt;
+    }
+    for (int i = 0; i < master_count; i++) {
+      if ( masters[i].txpending && !txactive && tx_cache.ready && ((nextt == 0) || (masters[i].tx_startt < nextt)) )
+        nextt = masters[i].tx_startt;
     }
+    timer_arm(hangfd, nextt, 0);
   }
 }